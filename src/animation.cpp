@@ -0,0 +1,260 @@
+#include "animation.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <glm/glm.hpp>
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+Vector Track::at(float frame) const {
+    if (frame <= frames.front()) {
+        return values.front();
+    }
+    if (frame >= frames.back()) {
+        return values.back();
+    }
+    const size_t next = std::upper_bound(frames.begin(), frames.end(), frame) - frames.begin();
+    const float f = (frame - frames[next - 1]) / (frames[next] - frames[next - 1]);
+    return values[next - 1] + f * (values[next] - values[next - 1]);
+}
+
+static bool has(const json &object, const char *key) {
+    return object.find(key) != object.end();
+}
+
+static bool animationError(const std::string &fn, const std::string &what) {
+    std::cout << "*** " << fn << ": " << what << std::endl;
+    return false;
+}
+
+// A keyed property of something: its name in the file, its track and whether it's one number
+// rather than three
+struct Keyable {
+    const char *name;
+    Track *track;
+    bool scalar;
+};
+
+// Add a key list's values to the tracks named in it; what says whose keys they are, for errors
+static bool readKeys(const std::string &fn, const json &keys, const std::vector<Keyable> &keyables, const std::string &what) {
+    if (!keys.is_array() || keys.empty()) {
+        return animationError(fn, what + " needs a list of keys");
+    }
+    float last = -1;
+    for (const json &key : keys) {
+        if (!key.is_object() || !has(key, "frame") || !key["frame"].is_number() || key["frame"].get<float>() <= last) {
+            return animationError(fn, "each of " + what + "'s keys needs a frame, after the last key's");
+        }
+        last = key["frame"].get<float>();
+        for (auto item = key.begin(); item != key.end(); ++item) {
+            if (item.key() == "frame") {
+                continue;
+            }
+            const Keyable *keyable = NULL;
+            for (const Keyable &k : keyables) {
+                if (item.key() == k.name) {
+                    keyable = &k;
+                }
+            }
+            if (keyable == NULL) {
+                return animationError(fn, what + " has no \"" + item.key() + "\" to key");
+            }
+            const json &value = item.value();
+            Vector v(0, 0, 0);
+            if (keyable->scalar && value.is_number()) {
+                v.x = value.get<float>();
+            } else if (!keyable->scalar && value.is_array() && value.size() == 3 && value[0].is_number() && value[1].is_number() && value[2].is_number()) {
+                v = Vector(value[0].get<float>(), value[1].get<float>(), value[2].get<float>());
+            } else {
+                return animationError(fn, what + "'s \"" + item.key() + "\" should be " + (keyable->scalar ? "a number" : "three numbers"));
+            }
+            keyable->track->frames.push_back(last);
+            keyable->track->values.push_back(v);
+        }
+    }
+    return true;
+}
+
+// the list of {"object"/"light": index, "keys": [...]} entries under name, if there is one
+static bool readIndexedKeys(const std::string &fn, const json &janimation, const char *name, const char *indexName, size_t count,
+                            std::vector<std::pair<uint32_t, const json*> > &entries) {
+    if (!has(janimation, name)) {
+        return true;
+    }
+    const json &list = janimation[name];
+    if (!list.is_array()) {
+        return animationError(fn, std::string("\"") + name + "\" should be a list");
+    }
+    for (const json &entry : list) {
+        if (!entry.is_object() || !has(entry, indexName) || !entry[indexName].is_number_unsigned() || entry[indexName].get<size_t>() >= count) {
+            return animationError(fn, std::string("each of \"") + name + "\" needs the index of one of the scene's " + name);
+        }
+        if (!has(entry, "keys")) {
+            return animationError(fn, std::string("each of \"") + name + "\" needs keys");
+        }
+        entries.push_back(std::make_pair(entry[indexName].get<uint32_t>(), &entry["keys"]));
+    }
+    return true;
+}
+
+bool loadAnimation(const std::string &fn, const Scene &scene, Animation &animation) {
+    std::ifstream in(fn);
+    if (!in.is_open()) {
+        return animationError(fn, "unable to open");
+    }
+    // the keyframes are small, so unlike a scene they're read into a DOM
+    const json janimation = json::parse(in, nullptr, false);
+    if (janimation.is_discarded() || !janimation.is_object()) {
+        return animationError(fn, "not a JSON object");
+    }
+    if (!has(janimation, "frames") || !janimation["frames"].is_number_unsigned() || janimation["frames"].get<int>() < 1) {
+        return animationError(fn, "\"frames\" should be how many frames to render");
+    }
+    animation = Animation();
+    animation.frames = janimation["frames"].get<int>();
+
+    if (has(janimation, "camera")) {
+        const std::vector<Keyable> keyables = {
+            { "position", &animation.cameraPosition, false },
+            { "field", &animation.cameraField, true },
+            { "background", &animation.cameraBackground, false } };
+        if (!readKeys(fn, janimation["camera"], keyables, "the camera")) {
+            return false;
+        }
+    }
+
+    std::vector<std::pair<uint32_t, const json*> > entries;
+    if (!readIndexedKeys(fn, janimation, "objects", "object", scene.objects.size(), entries)) {
+        return false;
+    }
+    for (auto &entry : entries) {
+        const Object *object = scene.objects[entry.first];
+        ObjectTrack t;
+        t.object = entry.first;
+        std::vector<Keyable> keyables;
+        switch (object->type) {
+        case ObjectType::Sphere:
+            keyables = { { "position", &t.position, false }, { "radius", &t.radius, true } };
+            break;
+        case ObjectType::Plane:
+            keyables = { { "position", &t.position, false }, { "normal", &t.normal, false } };
+            break;
+        case ObjectType::Mesh:
+        case ObjectType::Instance:
+            keyables = { { "scale", &t.scale, true }, { "rotate", &t.rotate, false }, { "translate", &t.translate, false } };
+            break;
+        }
+        const std::string what = "object " + std::to_string(entry.first) + " (a " + objectTypeName(object->type) + ")";
+        if (!readKeys(fn, *entry.second, keyables, what)) {
+            return false;
+        }
+        if (object->type == ObjectType::Mesh) {
+            t.rest = ((const Mesh*)object)->vertices;
+            Vertex lo = t.rest.empty() ? Vertex(0, 0, 0) : t.rest[0], hi = lo;
+            for (const Vertex &v : t.rest) {
+                lo = glm::min(lo, v);
+                hi = glm::max(hi, v);
+            }
+            t.centre = (lo + hi) * 0.5f;
+        } else if (object->type == ObjectType::Instance) {
+            const Instance *instance = (const Instance*)object;
+            t.restPlacement = instance->toWorld;
+            t.centre = (instance->boundsMin + instance->boundsMax) * 0.5f;
+        }
+        animation.objects.push_back(std::move(t));
+    }
+
+    entries.clear();
+    if (!readIndexedKeys(fn, janimation, "lights", "light", scene.lights.size(), entries)) {
+        return false;
+    }
+    for (auto &entry : entries) {
+        const Light *light = scene.lights[entry.first];
+        LightTrack t;
+        t.light = entry.first;
+        std::vector<Keyable> keyables = { { "color", &t.color, false } };
+        if (light->type == LightType::Point || light->type == LightType::Spot) {
+            keyables.push_back({ "position", &t.position, false });
+        }
+        if (light->type == LightType::Directional || light->type == LightType::Spot) {
+            keyables.push_back({ "direction", &t.direction, false });
+        }
+        if (light->type == LightType::Spot) {
+            keyables.push_back({ "cutoff", &t.cutoff, true });
+        }
+        if (!readKeys(fn, *entry.second, keyables, "light " + std::to_string(entry.first))) {
+            return false;
+        }
+        animation.lights.push_back(t);
+    }
+    return true;
+}
+
+// The keyed turn about the object's centre, then the keyed offset
+static Transform keyedTransform(const ObjectTrack &t, float frame) {
+    const float scale = t.scale.empty() ? 1.0f : t.scale.at(frame).x;
+    const Vector rotate = t.rotate.empty() ? Vector(0, 0, 0) : t.rotate.at(frame);
+    const Vector translate = t.translate.empty() ? Vector(0, 0, 0) : t.translate.at(frame);
+    Transform keyed = Transform::placement(scale, rotate, Vector(0, 0, 0));
+    keyed.translation = t.centre + translate - keyed.vector(t.centre);
+    return keyed;
+}
+
+bool poseFrame(const Animation &animation, int frame, Scene &scene, View &view) {
+    const float f = (float)frame;
+    if (!animation.cameraPosition.empty()) {
+        view.lookFrom = animation.cameraPosition.at(f);
+    }
+    if (!animation.cameraField.empty()) {
+        scene.camera.field = animation.cameraField.at(f).x;
+        fov = scene.camera.field;
+    }
+    if (!animation.cameraBackground.empty()) {
+        scene.camera.background = animation.cameraBackground.at(f);
+        background_colour = scene.camera.background;
+    }
+
+    for (const ObjectTrack &t : animation.objects) {
+        Object *object = scene.objects[t.object];
+        switch (object->type) {
+        case ObjectType::Sphere:
+            if (!t.position.empty()) ((Sphere*)object)->position = t.position.at(f);
+            if (!t.radius.empty()) ((Sphere*)object)->radius = t.radius.at(f).x;
+            break;
+        case ObjectType::Plane:
+            if (!t.position.empty()) ((Plane*)object)->position = t.position.at(f);
+            if (!t.normal.empty()) ((Plane*)object)->normal = t.normal.at(f);
+            break;
+        case ObjectType::Mesh: {
+            const Transform keyed = keyedTransform(t, f);
+            std::vector<Vertex> &vertices = ((Mesh*)object)->vertices;
+            for (size_t i = 0; i < vertices.size(); i++) {
+                vertices[i] = keyed.point(t.rest[i]);
+            }
+            break;
+        }
+        case ObjectType::Instance:
+            // refit_scene() bounds it again
+            ((Instance*)object)->place(keyedTransform(t, f).after(t.restPlacement));
+            break;
+        }
+    }
+
+    for (const LightTrack &t : animation.lights) {
+        Light *light = scene.lights[t.light];
+        if (!t.color.empty()) light->color = t.color.at(f);
+        if (light->type == LightType::Point) {
+            if (!t.position.empty()) ((PointLight*)light)->position = t.position.at(f);
+        } else if (light->type == LightType::Directional) {
+            if (!t.direction.empty()) ((DirectionalLight*)light)->direction = t.direction.at(f);
+        } else if (light->type == LightType::Spot) {
+            SpotLight *spot = (SpotLight*)light;
+            if (!t.position.empty()) spot->position = t.position.at(f);
+            if (!t.direction.empty()) spot->direction = t.direction.at(f);
+            if (!t.cutoff.empty()) spot->cutoff = t.cutoff.at(f).x;
+        }
+    }
+    return !animation.objects.empty();
+}
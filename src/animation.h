@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "schema.h"
+#include "camera.h"
+
+// One keyframed property: its values at some frames, linearly interpolated between them and
+// held before the first and after the last. Scalars use only x.
+struct Track {
+    std::vector<float> frames;      // increasing
+    std::vector<Vector> values;
+
+    bool empty() const { return frames.empty(); }
+    Vector at(float frame) const;
+};
+
+// The keyframes for one of the scene's objects, named by its index in the scene's "objects".
+// Spheres and planes take their keyed position, radius and normal as they are. Meshes and
+// instances are scaled and rotated (radians about x, y and z) about the centre of their bounds
+// where the scene put them, then translated by the keyed offset.
+struct ObjectTrack {
+    uint32_t object;
+    Track position, radius, normal;
+    Track scale, rotate, translate;
+    Vertex centre;                  // meshes and instances: what they turn about
+    std::vector<Vertex> rest;       // meshes: their vertices as loaded
+    Transform restPlacement;        // instances: their placement as loaded
+};
+
+// The keyframes for one of the scene's lights, named by its index in the scene's "lights"
+struct LightTrack {
+    uint32_t light;
+    Track color, position, direction, cutoff;
+};
+
+// A sequence of frames over a loaded scene. The camera keys move the eye (View::lookFrom) and
+// change the field of view and background; the view direction is fixed, as it is for a still.
+struct Animation {
+    int frames;
+    Track cameraPosition, cameraField, cameraBackground;
+    std::vector<ObjectTrack> objects;
+    std::vector<LightTrack> lights;
+
+    Animation() : frames(0) {}
+};
+
+// Read fn's keyframes for scene, which must already be loaded, e.g.
+//  { "frames": 48,
+//    "camera": [ { "frame": 0, "position": [0, 0, 0], "field": 60 }, { "frame": 47, "position": [0, 1, 2] } ],
+//    "objects": [ { "object": 2, "keys": [ { "frame": 0, "rotate": [0, 0, 0] }, { "frame": 47, "rotate": [0, 6.2832, 0] } ] } ],
+//    "lights": [ { "light": 1, "keys": [ { "frame": 0, "color": [1, 1, 1] }, { "frame": 47, "color": [0.2, 0.2, 0.5] } ] } ] }
+// Returns false, after printing why, if the file can't be used with this scene.
+bool loadAnimation(const std::string& fn, const Scene& scene, Animation& animation);
+
+// Pose scene, the field of view, the background and view's eye for frame. Returns true if any
+// geometry moved, in which case the BVHs need refit_scene() before rendering.
+bool poseFrame(const Animation& animation, int frame, Scene& scene, View& view);
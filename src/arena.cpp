@@ -0,0 +1,50 @@
+#include "arena.h"
+
+#include <cstdint>
+
+void* Arena::allocate(size_t bytes, size_t alignment)
+{
+    uintptr_t at = ((uintptr_t)cursor + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (cursor == NULL || at + bytes > (uintptr_t)limit)
+    {
+        // new blocks come from operator new, so they are aligned for any fundamental type;
+        // the slack covers anything over-aligned
+        size_t blockBytes = nextBlockBytes;
+        if (blockBytes < bytes + alignment)
+        {
+            blockBytes = bytes + alignment;
+        }
+        else if (nextBlockBytes < ARENA_MAX_BLOCK_BYTES)
+        {
+            nextBlockBytes *= 2;
+        }
+        char* block = new char[blockBytes];
+        blocks.push_back(block);
+        reserved += blockBytes;
+        cursor = block;
+        limit = block + blockBytes;
+        at = ((uintptr_t)cursor + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    }
+    cursor = (char*)(at + bytes);
+    return (void*)at;
+}
+
+void Arena::clear()
+{
+    for (auto it = finalizers.rbegin(); it != finalizers.rend(); ++it)
+    {
+        it->destroy(it->object);
+    }
+    finalizers.clear();
+    finalizers.shrink_to_fit();
+    for (char* block : blocks)
+    {
+        delete[] block;
+    }
+    blocks.clear();
+    blocks.shrink_to_fit();
+    cursor = NULL;
+    limit = NULL;
+    nextBlockBytes = ARENA_FIRST_BLOCK_BYTES;
+    reserved = 0;
+}
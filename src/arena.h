@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Block sizes start small, so a tiny scene doesn't reserve much, and double up to the maximum
+const size_t ARENA_FIRST_BLOCK_BYTES = 4096;
+const size_t ARENA_MAX_BLOCK_BYTES = 1 << 20;
+
+// A bump allocator for objects that are all freed together. make() constructs objects in
+// place in a few large blocks; clear() or the destructor runs their destructors, newest
+// first, and releases the blocks in one go. Not thread-safe: give each thread its own.
+class Arena {
+public:
+    Arena() : cursor(NULL), limit(NULL), nextBlockBytes(ARENA_FIRST_BLOCK_BYTES), reserved(0) {}
+    ~Arena() { clear(); }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+        T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value)
+        {
+            finalizers.push_back({ object, &destroy<T> });
+        }
+        return object;
+    }
+
+    // Raw storage, freed by clear() like everything else
+    void* allocate(size_t bytes, size_t alignment);
+    // Destroy every object made here and free all the blocks; the arena can then be reused
+    void clear();
+    // Block memory currently held
+    size_t bytes() const { return reserved; }
+
+private:
+    struct Finalizer {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    template <typename T>
+    static void destroy(void* object) { static_cast<T*>(object)->~T(); }
+
+    std::vector<char*> blocks;
+    std::vector<Finalizer> finalizers;
+    char* cursor;       // next free byte of the newest block
+    char* limit;        // end of the newest block
+    size_t nextBlockBytes;
+    size_t reserved;
+};
@@ -0,0 +1,98 @@
+// Ray Tracer scene cache baker
+// Loads JSON scenes, builds their BVHs and writes each out as scenes/<name>.rtscene (see
+// scenecache.h), so later runs with the same BVH options skip the parsing and the build, e.g.
+//  ../build/bakescene b cornell
+
+#include "raytracer.h"
+#include "scenecache.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <vector>
+
+static void usage(const char* prog) {
+    std::cout << "usage: " << prog << " [-t threads] [--bvh median|sah] [--sah-bins n] [--leaf-size n] [--bvh-width 2|4] scene...\n"
+              << "  each scene is a name in scenes/ without the .json suffix\n"
+              << "  the BVH options must match the ones the cache will be loaded with\n";
+}
+
+int main(int argc, char** argv) {
+    BVHBuildOptions bvhOptions;
+    std::vector<const char*> sceneNames;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = !strcmp(argv[i], "-t") || !strcmp(argv[i], "--bvh") || !strcmp(argv[i], "--sah-bins")
+            || !strcmp(argv[i], "--leaf-size") || !strcmp(argv[i], "--bvh-width");
+        if (hasValue && i + 1 >= argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (!strcmp(argv[i], "-t")) {
+            bvhOptions.threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--bvh")) {
+            const char* builder = argv[++i];
+            if (!strcmp(builder, "median")) {
+                bvhOptions.builder = BVHBuilder::Median;
+            }
+            else if (!strcmp(builder, "sah")) {
+                bvhOptions.builder = BVHBuilder::SAH;
+            }
+            else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strcmp(argv[i], "--sah-bins")) {
+            bvhOptions.sahBins = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--leaf-size")) {
+            bvhOptions.maxLeafSize = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--bvh-width")) {
+            int width = atoi(argv[++i]);
+            if (width == 2) {
+                bvhOptions.layout = BVHLayout::Binary;
+            }
+            else if (width == BVH_WIDE) {
+                bvhOptions.layout = BVHLayout::Wide;
+            }
+            else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strcmp(argv[i], "--help")) {
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        }
+        else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        else {
+            sceneNames.push_back(argv[i]);
+        }
+    }
+    if (sceneNames.empty()) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (const char* name : sceneNames) {
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        choose_scene(name, bvhOptions, false);
+        std::chrono::high_resolution_clock::time_point loaded = std::chrono::high_resolution_clock::now();
+        if (!save_scene_cache(name)) {
+            std::cout << "Unable to write scenes/" << name << SCENE_CACHE_SUFFIX << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::chrono::high_resolution_clock::time_point written = std::chrono::high_resolution_clock::now();
+        std::cout << "Wrote scenes/" << name << SCENE_CACHE_SUFFIX << ": loaded and built in "
+                  << std::chrono::duration<double, std::milli>(loaded - start).count() << " ms, written in "
+                  << std::chrono::duration<double, std::milli>(written - loaded).count() << " ms" << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
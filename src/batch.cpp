@@ -0,0 +1,284 @@
+// Ray Tracer headless batch renderer
+// Renders a whole frame without GLUT/OpenGL and writes it to disk, e.g.
+//  ../build/batch -w 1024 -h 768 -o b.ppm b
+
+#include "raytracer.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "tiles.h"
+#include "animation.h"
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <sys/resource.h>
+
+// largest resident set the process has had so far
+static size_t peakRSSBytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss;             // bytes
+#else
+    return (size_t)usage.ru_maxrss * 1024;      // kilobytes
+#endif
+}
+
+// Frame n of a sequence written as output: out.ppm becomes out_0000.ppm, out_0001.ppm, ...
+static std::string frameName(const std::string& output, int n) {
+    char number[16];
+    snprintf(number, sizeof(number), "_%04d", n);
+    const size_t dot = output.rfind('.');
+    const size_t slash = output.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return output + number;
+    }
+    return output.substr(0, dot) + number + output.substr(dot);
+}
+
+// Render every frame of animation over the loaded scene, which is posed for each frame in turn.
+// Only its BVHs are updated between frames, and only when something in them moved.
+static int renderSequence(const Animation& animation, View& view, bool antialias, ShadingMode shading, const TileOptions& tileOptions,
+                          const std::string& output, double loadMs) {
+    Framebuffer fb(view.width, view.height);
+    double updateMs = 0, renderMs = 0;
+    int rebuilds = 0;
+    for (int frame = 0; frame < animation.frames; frame++) {
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        // keyframes move objects, never the meshes instances share, so those trees stay as they are
+        if (poseFrame(animation, frame, loaded_scene(), view) && refit_scene(BVH_REBUILD_RATIO, false)) {
+            rebuilds++;
+        }
+        std::chrono::high_resolution_clock::time_point posed = std::chrono::high_resolution_clock::now();
+        renderFrameTiled(view, antialias, shading, fb, tileOptions, NULL);
+        std::chrono::high_resolution_clock::time_point rendered = std::chrono::high_resolution_clock::now();
+
+        const std::string name = frameName(output, frame);
+        if (!writePPM(fb, name)) {
+            std::cout << "Unable to write image " << name << std::endl;
+            return EXIT_FAILURE;
+        }
+        const double frameUpdateMs = std::chrono::duration<double, std::milli>(posed - start).count();
+        const double frameRenderMs = std::chrono::duration<double, std::milli>(rendered - posed).count();
+        updateMs += frameUpdateMs;
+        renderMs += frameRenderMs;
+        std::cout << "Frame " << frame << ": update " << frameUpdateMs << " ms, render " << frameRenderMs << " ms, wrote " << name << std::endl;
+    }
+    std::cout << "Scene load: " << loadMs << " ms, once" << std::endl;
+    std::cout << animation.frames << " frames " << view.width << "x" << view.height << ": " << updateMs << " ms posing and refitting ("
+              << rebuilds << " with a rebuild), " << renderMs << " ms rendering, "
+              << animation.frames / ((loadMs + updateMs + renderMs) / 1000.0) << " frames/s overall" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+static void usage(const char* prog) {
+    std::cout << "usage: " << prog << " [-w width] [-h height] [-o output.ppm] [-t threads] [--tile size] [--bvh median|sah] [--sah-bins n] [--leaf-size n] [--bvh-width 2|4] [--shading mode] [--no-aa] [--no-cache] [--animate keys.json] [scene]\n"
+              << "  scene is a name in scenes/ without the .json suffix (default b)\n"
+              << "  threads (for the BVH build and the render) defaults to one per hardware thread; tiles are 16x16 pixels by default\n"
+              << "  mode is final (the default), preview, brute-force, toon, outline or sketch\n"
+              << "  scenes/<scene>.rtscene (see bakescene) is loaded instead of the JSON when it is up to date, unless --no-cache\n"
+              << "  --animate renders the frames keyed in keys.json (see animation.h) over the one loaded scene, as output_0000.ppm and so on\n";
+}
+
+int main(int argc, char** argv) {
+    int width = 512;
+    int height = 512;
+    bool antialias = true;
+    bool useCache = true;
+    ShadingMode shading = ShadingMode::Final;
+    const char* sceneName = NULL;
+    std::string output;
+    std::string animationFile;
+    TileOptions tileOptions;
+    BVHBuildOptions bvhOptions;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = !strcmp(argv[i], "-w") || !strcmp(argv[i], "-h") || !strcmp(argv[i], "-o") || !strcmp(argv[i], "-t") || !strcmp(argv[i], "--tile")
+            || !strcmp(argv[i], "--bvh") || !strcmp(argv[i], "--sah-bins") || !strcmp(argv[i], "--leaf-size")
+            || !strcmp(argv[i], "--bvh-width") || !strcmp(argv[i], "--shading") || !strcmp(argv[i], "--animate");
+        if (hasValue && i + 1 >= argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (!strcmp(argv[i], "-w")) {
+            width = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-h")) {
+            height = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-o")) {
+            output = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-t")) {
+            tileOptions.threads = atoi(argv[++i]);
+            bvhOptions.threads = tileOptions.threads;
+        }
+        else if (!strcmp(argv[i], "--tile")) {
+            tileOptions.tileSize = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--bvh")) {
+            const char* builder = argv[++i];
+            if (!strcmp(builder, "median")) {
+                bvhOptions.builder = BVHBuilder::Median;
+            }
+            else if (!strcmp(builder, "sah")) {
+                bvhOptions.builder = BVHBuilder::SAH;
+            }
+            else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strcmp(argv[i], "--sah-bins")) {
+            bvhOptions.sahBins = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--leaf-size")) {
+            bvhOptions.maxLeafSize = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--bvh-width")) {
+            int width = atoi(argv[++i]);
+            if (width == 2) {
+                bvhOptions.layout = BVHLayout::Binary;
+            }
+            else if (width == BVH_WIDE) {
+                bvhOptions.layout = BVHLayout::Wide;
+            }
+            else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strcmp(argv[i], "--shading")) {
+            const char* mode = argv[++i];
+            if (!strcmp(mode, "final")) {
+                shading = ShadingMode::Final;
+            }
+            else if (!strcmp(mode, "preview")) {
+                shading = ShadingMode::Preview;
+            }
+            else if (!strcmp(mode, "brute-force")) {
+                shading = ShadingMode::BruteForce;
+            }
+            else if (!strcmp(mode, "toon")) {
+                shading = ShadingMode::Toon;
+            }
+            else if (!strcmp(mode, "outline")) {
+                shading = ShadingMode::Outline;
+            }
+            else if (!strcmp(mode, "sketch")) {
+                shading = ShadingMode::Sketch;
+            }
+            else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strcmp(argv[i], "--animate")) {
+            animationFile = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--no-aa")) {
+            antialias = false;
+        }
+        else if (!strcmp(argv[i], "--no-cache")) {
+            useCache = false;
+        }
+        else if (!strcmp(argv[i], "--help")) {
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        }
+        else if (argv[i][0] == '-' || sceneName != NULL) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        else {
+            sceneName = argv[i];
+        }
+    }
+
+    if (width <= 0 || height <= 0) {
+        std::cout << "Invalid resolution " << width << "x" << height << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (output.empty()) {
+        output = std::string(sceneName ? sceneName : "b") + ".ppm";
+    }
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    choose_scene(sceneName, bvhOptions, useCache);
+    std::chrono::high_resolution_clock::time_point loaded = std::chrono::high_resolution_clock::now();
+
+    const bool wide = bvhOptions.layout == BVHLayout::Wide;
+    BVHStats bvh = wide ? bvhStats(scene_wide_bvh()) : bvhStats(scene_bvh());
+    std::cout << "BVH (" << (bvhOptions.builder == BVHBuilder::SAH ? "sah" : "median") << ", " << (wide ? BVH_WIDE : 2) << " wide): " << bvh.nodes << " nodes, "
+              << bvh.leaves << " leaves, depth " << bvh.depth << ", SAH cost " << bvh.sahCost << std::endl;
+    std::cout << "  memory: " << bvh.bytes << " bytes flattened";
+    if (!wide) {
+        std::cout << " (" << bvh.linkedBytes << " as a linked tree)";
+    }
+    std::cout << std::endl;
+    if (bvh.triangles > 0) {
+        std::cout << "  triangles: " << bvh.triangles << ", " << bvh.triangleBytes << " bytes ("
+                  << bvh.triangleBytes / (double)bvh.triangles << " per triangle)" << std::endl;
+    }
+    const size_t meshes = wide ? scene_mesh_wide_bvhs().size() : scene_mesh_bvhs().size();
+    if (meshes > 0) {
+        size_t meshBytes = 0, meshTriangles = 0;
+        for (size_t i = 0; i < meshes; i++) {
+            BVHStats m = wide ? bvhStats(scene_mesh_wide_bvhs()[i]) : bvhStats(scene_mesh_bvhs()[i]);
+            meshBytes += m.bytes + m.triangleBytes;
+            meshTriangles += m.triangles;
+        }
+        std::cout << "  instanced meshes: " << meshes << " bottom-level BVHs, " << meshTriangles << " triangles, "
+                  << meshBytes << " bytes with their triangles" << std::endl;
+    }
+    const BVHBuildStats& build = wide ? scene_wide_bvh().build : scene_bvh().build;
+    std::cout << "  build: " << build.ms << " ms for " << build.primitives << " primitives, " << build.tasks << " subtree tasks on up to "
+              << build.threads << " threads, " << build.peakBytes << " bytes peak working memory" << std::endl;
+    std::cout << "Peak RSS after load: " << peakRSSBytes() / (1024 * 1024) << " MB" << std::endl;
+
+    View view(width, height);
+    if (!animationFile.empty()) {
+        Animation animation;
+        if (!loadAnimation(animationFile, loaded_scene(), animation)) {
+            return EXIT_FAILURE;
+        }
+        return renderSequence(animation, view, antialias, shading, tileOptions, output, std::chrono::duration<double, std::milli>(loaded - start).count());
+    }
+    Framebuffer fb(width, height);
+    std::vector<TileWorkerStats> workerStats;
+    renderFrameTiled(view, antialias, shading, fb, tileOptions, &workerStats);
+    std::chrono::high_resolution_clock::time_point rendered = std::chrono::high_resolution_clock::now();
+
+    if (!writePPM(fb, output)) {
+        std::cout << "Unable to write image " << output << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    double loadMs = std::chrono::duration<double, std::milli>(loaded - start).count();
+    double renderMs = std::chrono::duration<double, std::milli>(rendered - loaded).count();
+    std::cout << "Scene load: " << loadMs << " ms" << std::endl;
+    std::cout << "Render " << width << "x" << height << ": " << renderMs << " ms ("
+              << (width * (double)height) / (renderMs / 1000.0) << " pixels/s)" << std::endl;
+    RayStats rays;
+    for (size_t i = 0; i < workerStats.size(); i++) {
+        rays += workerStats[i].rays;
+    }
+    std::cout << "Rays: " << rays.primaryRays << " primary, " << rays.shadowRays << " shadow, " << rays.rays << " total" << std::endl;
+    std::cout << "  per primary ray: " << rays.primaryBoxTests / (double)rays.primaryRays << " box tests, "
+              << rays.primaryTriangleTests / (double)rays.primaryRays << " triangle tests" << std::endl;
+    std::cout << "  per ray: " << rays.boxTests / (double)rays.rays << " box tests, "
+              << rays.triangleTests / (double)rays.rays << " triangle tests" << std::endl;
+    std::cout << "  " << rays.triangleTests / (renderMs / 1000.0) << " triangle tests per second" << std::endl;
+    for (size_t i = 0; i < workerStats.size(); i++) {
+        std::cout << "  thread " << i << ": " << workerStats[i].tiles << " tiles (" << workerStats[i].stolen << " stolen), "
+                  << workerStats[i].ms << " ms" << std::endl;
+    }
+    std::cout << "Wrote " << output << std::endl;
+
+    return EXIT_SUCCESS;
+}
@@ -1,156 +1,781 @@
-#include "bvh.h"
-#include "schema.h"
-
-#include <iostream>
-#include <string>
-#include <glm/glm.hpp>
-#include <glm/gtx/string_cast.hpp>
-#include <algorithm>
-#include <memory>
-#include <tuple>
-
-
-bool compareAxis(int axis, const std::tuple<Object*, glm::vec3, glm::vec3>& obj1, const std::tuple<Object*, glm::vec3, glm::vec3>& obj2) {
-    float obj1Pos = 0.0f;
-    float obj2Pos = 0.0f;
-    if (std::get<0>(obj1)->type == "sphere") {
-        Sphere* sphere = (Sphere*)(std::get<0>(obj1));
-        obj1Pos = sphere->position[axis];
-    }
-    else if (std::get<0>(obj1)->type == "mTriangle") {
-        MTriangle* mTriangle = (MTriangle*)(std::get<0>(obj1));
-        obj1Pos = mTriangle->midPoint[axis];
-    }
-
-    if (std::get<0>(obj2)->type == "sphere") {
-        Sphere* sphere = (Sphere*)(std::get<0>(obj2));
-        obj2Pos = sphere->position[axis];
-    }
-    else if (std::get<0>(obj2)->type == "mTriangle") {
-        MTriangle* mTriangle = (MTriangle*)(std::get<0>(obj2));
-        obj2Pos = mTriangle->midPoint[axis];
-    }
-    
-    return obj1Pos < obj2Pos;
-}
-
-BVHNode* subdivide(std::vector<std::tuple<Object*, glm::vec3, glm::vec3>> bvhObjects)
-{
-    BVHNode* ret = new BVHNode();
-
-    // recurse base case
-    if (bvhObjects.size() == 1)
-    {
-        ret->obj = std::get<0>(bvhObjects[0]);
-        ret->aabbMinBound = std::get<1>(bvhObjects[0]);
-        ret->aabbMaxBound = std::get<2>(bvhObjects[0]);
-        return ret;
-    }
-
-    // calculate global bounding box
-    Vector globalMinBound(float(1e30f), float(1e30f), float(1e30f));
-    Vector globalMaxBound(float(-1e30f), float(-1e30f), float(-1e30f));
-    for (auto& currObj : bvhObjects)
-    {
-        Vector currMinBound = std::get<1>(currObj);
-        Vector currMaxBound = std::get<2>(currObj);
-
-        globalMinBound.x = std::min(globalMinBound.x, currMinBound.x);
-        globalMinBound.y = std::min(globalMinBound.y, currMinBound.y);
-        globalMinBound.z = std::min(globalMinBound.z, currMinBound.z);
-    
-        globalMaxBound.x = std::max(globalMaxBound.x, currMaxBound.x);
-        globalMaxBound.y = std::max(globalMaxBound.y, currMaxBound.y);
-        globalMaxBound.z = std::max(globalMaxBound.z, currMaxBound.z);
-    }
-    ret->aabbMinBound = globalMinBound;
-    ret->aabbMaxBound = globalMaxBound;
-
-    Vector extent = globalMaxBound - globalMinBound;
-    int longestAxis = 0;
-
-    if (extent.x < extent.y && extent.z < extent.y)
-    {
-        longestAxis = 1;
-    }
-    else if(extent.x < extent.z && extent.y < extent.z)
-    {
-        longestAxis = 2;
-    }
-
-    // Sort the bvhObjects list based on longestAxis
-    std::sort(bvhObjects.begin(), bvhObjects.end(),
-        [longestAxis](const std::tuple<Object*, glm::vec3, glm::vec3>& obj1, const std::tuple<Object*, glm::vec3, glm::vec3>& obj2) {
-            return compareAxis(longestAxis, obj1, obj2);
-        });
-
-
-    const auto half = bvhObjects.begin() + bvhObjects.size() / 2;
-    auto leftHalfBVHNodes = std::vector<std::tuple<Object*, glm::vec3, glm::vec3>>(bvhObjects.begin(), half);
-    auto rightHalfBVHNodes = std::vector<std::tuple<Object*, glm::vec3, glm::vec3>>(half, bvhObjects.end());
-    
-    ret->left = subdivide(leftHalfBVHNodes);
-    ret->right = subdivide(rightHalfBVHNodes);
-
-    return ret;
-}
-
-BVHNode* buildBVH(const std::vector<Object*>& objects)
-{
-    std::vector<std::tuple<Object*, glm::vec3, glm::vec3>> bvhObjects;
-    // filter and calculate per-object bounding box, then push back to sorted
-    for (auto object : objects)
-    {
-        if (object->type == "sphere")
-        {
-            const float radius = ((Sphere*)object)->radius;
-            const glm::vec3& pos = ((Sphere*)object)->position;
-
-            Vector minBound = Vector(pos.x - radius, pos.y - radius, pos.z - radius);
-            Vector maxBound = Vector(pos.x + radius, pos.y + radius, pos.z + radius);
-
-            bvhObjects.push_back(std::make_tuple(object, minBound, maxBound));
-        }
-        else if (object->type == "mesh")
-        {
-            Mesh* mesh = (Mesh*)(object);
-            const auto& triangles = mesh->triangles;
-
-            for (int i = 0; i < triangles.size(); i++)
-            {
-                MTriangle* mTriangle = new MTriangle(mesh->material, triangles[i]);
-                Vector minBound = Vector(float(1e30f), float(1e30f), float(1e30f));
-                Vector maxBound = Vector(float(-1e30f), float(-1e30f), float(-1e30f));
-
-                minBound.x = std::min(triangles[i].vertices[0].x, minBound.x);
-                minBound.x = std::min(triangles[i].vertices[1].x, minBound.x);
-                minBound.x = std::min(triangles[i].vertices[2].x, minBound.x);
-
-                minBound.y = std::min(triangles[i].vertices[0].y, minBound.y);
-                minBound.y = std::min(triangles[i].vertices[1].y, minBound.y);
-                minBound.y = std::min(triangles[i].vertices[2].y, minBound.y);
-
-                minBound.z = std::min(triangles[i].vertices[0].z, minBound.z);
-                minBound.z = std::min(triangles[i].vertices[1].z, minBound.z);
-                minBound.z = std::min(triangles[i].vertices[2].z, minBound.z);
-
-                maxBound.x = std::max(triangles[i].vertices[0].x, maxBound.x);
-                maxBound.x = std::max(triangles[i].vertices[1].x, maxBound.x);
-                maxBound.x = std::max(triangles[i].vertices[2].x, maxBound.x);
-
-                maxBound.y = std::max(triangles[i].vertices[0].y, maxBound.y);
-                maxBound.y = std::max(triangles[i].vertices[1].y, maxBound.y);
-                maxBound.y = std::max(triangles[i].vertices[2].y, maxBound.y);
-
-                maxBound.z = std::max(triangles[i].vertices[0].z, maxBound.z);
-                maxBound.z = std::max(triangles[i].vertices[1].z, maxBound.z);
-                maxBound.z = std::max(triangles[i].vertices[2].z, maxBound.z);
-
-                mTriangle->midPoint = Vertex((maxBound.x + minBound.x) / 2.0f, (maxBound.y + minBound.y) / 2.0f, (maxBound.z + minBound.z) / 2.0f);
-
-                bvhObjects.push_back(std::make_tuple(mTriangle, minBound, maxBound));
-            }
-        }
-    }
-    return subdivide(bvhObjects);
-}
+#include "bvh.h"
+#include "schema.h"
+
+#include <iostream>
+#include <string>
+#include <glm/glm.hpp>
+#include <glm/gtx/string_cast.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+
+// What the builder needs to know about each object; the tree is built by partitioning an
+// array of indices into these in place, so the records themselves never move
+struct BVHPrimitive {
+    Object* obj;            // a mesh triangle's mesh
+    uint32_t triangle;      // index into the mesh's triangles, or NOT_A_TRIANGLE for other objects
+    Vector minBound;
+    Vector maxBound;
+    Vector centroid;
+};
+
+struct BVHBuildState {
+    const std::vector<BVHPrimitive>& primitives;
+    const BVHBuildOptions& options;
+    int maxThreads;
+    std::atomic<int> threads;           // subtree tasks running, counting the caller
+    std::atomic<int> tasks;             // subtrees handed to another thread
+    std::atomic<size_t> nodes;
+    std::atomic<size_t> leafObjects;
+
+    BVHBuildState(const std::vector<BVHPrimitive>& primitives, const BVHBuildOptions& options, int maxThreads)
+        : primitives(primitives), options(options), maxThreads(maxThreads), threads(1), tasks(0), nodes(0), leafObjects(0) {}
+};
+
+const uint32_t NOT_A_TRIANGLE = 0xffffffff;
+
+// below this many objects a subtree is built on the thread that got there, not handed to a new one
+const size_t BVH_PARALLEL_MIN_OBJECTS = 4096;
+
+static float surfaceArea(const Vector& minBound, const Vector& maxBound)
+{
+    Vector extent = maxBound - minBound;
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+static int ceilLog2(size_t n)
+{
+    int levels = 0;
+    while (((size_t)1 << levels) < n)
+    {
+        levels++;
+    }
+    return levels;
+}
+
+// Binned SAH: bin the objects by centroid along each axis and try the split between every pair
+// of neighbouring bins, keeping the one with the lowest surface-area-weighted object count.
+// Returns false if there is no split that puts objects on both sides (e.g. all centroids equal).
+static bool sahSplit(const std::vector<BVHPrimitive>& primitives, uint32_t* begin, uint32_t* end, int bins, size_t& splitAt, int& splitAxis)
+{
+    Vector centroidMin(float(1e30f), float(1e30f), float(1e30f));
+    Vector centroidMax(float(-1e30f), float(-1e30f), float(-1e30f));
+    for (uint32_t* it = begin; it != end; ++it)
+    {
+        centroidMin = glm::min(centroidMin, primitives[*it].centroid);
+        centroidMax = glm::max(centroidMax, primitives[*it].centroid);
+    }
+
+    struct Bin {
+        int count;
+        Vector minBound;
+        Vector maxBound;
+    };
+    std::vector<Bin> binned(bins);
+    std::vector<float> rightArea(bins);
+    std::vector<int> rightCount(bins);
+
+    float bestCost = float(1e30f);
+    int bestAxis = -1;
+    int bestBin = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float extent = centroidMax[axis] - centroidMin[axis];
+        if (extent <= 0.0f)
+        {
+            continue;
+        }
+        float scale = bins / extent;
+
+        for (auto& bin : binned)
+        {
+            bin.count = 0;
+            bin.minBound = Vector(float(1e30f), float(1e30f), float(1e30f));
+            bin.maxBound = Vector(float(-1e30f), float(-1e30f), float(-1e30f));
+        }
+        for (uint32_t* it = begin; it != end; ++it)
+        {
+            const BVHPrimitive& prim = primitives[*it];
+            int b = std::min(bins - 1, (int)((prim.centroid[axis] - centroidMin[axis]) * scale));
+            binned[b].count++;
+            binned[b].minBound = glm::min(binned[b].minBound, prim.minBound);
+            binned[b].maxBound = glm::max(binned[b].maxBound, prim.maxBound);
+        }
+
+        // sweep from the right to get the cost of everything right of each split...
+        Vector minBound(float(1e30f), float(1e30f), float(1e30f));
+        Vector maxBound(float(-1e30f), float(-1e30f), float(-1e30f));
+        int count = 0;
+        for (int b = bins - 1; b > 0; b--)
+        {
+            count += binned[b].count;
+            minBound = glm::min(minBound, binned[b].minBound);
+            maxBound = glm::max(maxBound, binned[b].maxBound);
+            rightCount[b] = count;
+            rightArea[b] = count > 0 ? surfaceArea(minBound, maxBound) : 0.0f;
+        }
+
+        // ...then from the left, splitting between bin b - 1 and bin b
+        minBound = Vector(float(1e30f), float(1e30f), float(1e30f));
+        maxBound = Vector(float(-1e30f), float(-1e30f), float(-1e30f));
+        count = 0;
+        for (int b = 1; b < bins; b++)
+        {
+            count += binned[b - 1].count;
+            minBound = glm::min(minBound, binned[b - 1].minBound);
+            maxBound = glm::max(maxBound, binned[b - 1].maxBound);
+            if (count == 0 || rightCount[b] == 0)
+            {
+                continue;
+            }
+            float cost = count * surfaceArea(minBound, maxBound) + rightCount[b] * rightArea[b];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    if (bestAxis < 0)
+    {
+        return false;
+    }
+
+    const float scale = bins / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+    const float minCentroid = centroidMin[bestAxis];
+    uint32_t* middle = std::partition(begin, end,
+        [&](uint32_t index) {
+            float centroid = primitives[index].centroid[bestAxis];
+            return std::min(bins - 1, (int)((centroid - minCentroid) * scale)) < bestBin;
+        });
+    splitAt = middle - begin;
+    splitAxis = bestAxis;
+    return splitAt > 0 && splitAt < (size_t)(end - begin);
+}
+
+static void boundsOf(const std::vector<BVHPrimitive>& primitives, const uint32_t* begin, const uint32_t* end,
+                     Vector& minBound, Vector& maxBound)
+{
+    minBound = Vector(float(1e30f), float(1e30f), float(1e30f));
+    maxBound = Vector(float(-1e30f), float(-1e30f), float(-1e30f));
+    for (const uint32_t* it = begin; it != end; ++it)
+    {
+        minBound = glm::min(minBound, primitives[*it].minBound);
+        maxBound = glm::max(maxBound, primitives[*it].maxBound);
+    }
+}
+
+// triangles are tested TRIANGLE_LANES at a time, so a leaf of them costs one test per group
+static float leafCost(size_t count, bool triangles)
+{
+    return (triangles ? (count + TRIANGLE_LANES - 1) / TRIANGLE_LANES : count) * BVH_INTERSECT_COST;
+}
+
+static BVHNode* makeLeaf(BVHBuildState& state, const uint32_t* begin, const uint32_t* end, BVHNode* ret)
+{
+    for (const uint32_t* it = begin; it != end; ++it)
+    {
+        const BVHPrimitive& prim = state.primitives[*it];
+        if (prim.triangle != NOT_A_TRIANGLE)
+        {
+            ret->triangles.push_back({ (const Mesh*)prim.obj, prim.triangle });
+        }
+        else
+        {
+            ret->objects.push_back(prim.obj);
+        }
+    }
+    state.leafObjects += end - begin;
+    return ret;
+}
+
+// Builds the subtree over the objects indexed by [begin, end), reordering those indices in place.
+// Its nodes are made in arena, which only this thread uses.
+static BVHNode* subdivide(BVHBuildState& state, Arena& arena, uint32_t* begin, uint32_t* end, int depth)
+{
+    const std::vector<BVHPrimitive>& primitives = state.primitives;
+    const size_t count = end - begin;
+    BVHNode* ret = arena.make<BVHNode>();
+    state.nodes++;
+
+    // calculate global bounding box
+    Vector globalMinBound, globalMaxBound;
+    boundsOf(primitives, begin, end, globalMinBound, globalMaxBound);
+    ret->aabbMinBound = globalMinBound;
+    ret->aabbMaxBound = globalMaxBound;
+
+    // recurse base case
+    if (count == 1)
+    {
+        return makeLeaf(state, begin, end, ret);
+    }
+
+    // SAH splits can be lopsided; once the remaining depth budget is only just enough for
+    // median splits (which halve the list every level), use those so traversal stacks can't overflow
+    size_t splitAt = 0;
+    bool split = false;
+    if (state.options.builder == BVHBuilder::SAH && depth + ceilLog2(count) < BVH_MAX_DEPTH - 1)
+    {
+        split = sahSplit(primitives, begin, end, std::max(2, state.options.sahBins), splitAt, ret->axis);
+    }
+
+    if (!split)
+    {
+        Vector extent = globalMaxBound - globalMinBound;
+        int longestAxis = 0;
+
+        if (extent.x < extent.y && extent.z < extent.y)
+        {
+            longestAxis = 1;
+        }
+        else if(extent.x < extent.z && extent.y < extent.z)
+        {
+            longestAxis = 2;
+        }
+
+        // only the median has to be in place, with the smaller half before it
+        splitAt = count / 2;
+        std::nth_element(begin, begin + splitAt, end,
+            [&](uint32_t index1, uint32_t index2) {
+                return primitives[index1].centroid[longestAxis] < primitives[index2].centroid[longestAxis];
+            });
+        ret->axis = longestAxis;
+    }
+
+    uint32_t* half = begin + splitAt;
+
+    // small enough for a leaf: keep it as one if testing every object costs no more than
+    // visiting the two children and testing what's in them (weighted by the chance of hitting each).
+    // A leaf holds either triangles or other objects, so a mixed range is split by kind instead.
+    const int maxLeafSize = std::min(std::max(1, state.options.maxLeafSize), BVH_MAX_LEAF_SIZE);
+    if (count <= (size_t)maxLeafSize)
+    {
+        auto isTriangle = [&](uint32_t index) { return primitives[index].triangle != NOT_A_TRIANGLE; };
+        const size_t triangleCount = std::count_if(begin, end, isTriangle);
+        if (triangleCount > 0 && triangleCount < count)
+        {
+            half = std::partition(begin, end, isTriangle);
+            splitAt = triangleCount;
+        }
+        else
+        {
+            const bool triangles = triangleCount == count;
+            Vector leftMin, leftMax, rightMin, rightMax;
+            boundsOf(primitives, begin, half, leftMin, leftMax);
+            boundsOf(primitives, half, end, rightMin, rightMax);
+            const float area = surfaceArea(globalMinBound, globalMaxBound);
+            const float splitCost = BVH_TRAVERSAL_COST + (area > 0.0f
+                ? (leafCost(splitAt, triangles) * surfaceArea(leftMin, leftMax) + leafCost(count - splitAt, triangles) * surfaceArea(rightMin, rightMax)) / area
+                : leafCost(splitAt, triangles) + leafCost(count - splitAt, triangles));
+            if (leafCost(count, triangles) <= splitCost)
+            {
+                return makeLeaf(state, begin, end, ret);
+            }
+        }
+    }
+
+    // the halves are disjoint ranges of the index array, so they can be built concurrently;
+    // hand the left one to a new thread while there are threads to spare and enough work to pay for one
+    bool spawn = false;
+    if (splitAt >= BVH_PARALLEL_MIN_OBJECTS)
+    {
+        spawn = state.threads.fetch_add(1) < state.maxThreads;
+        if (!spawn)
+        {
+            state.threads--;
+        }
+    }
+    std::thread leftThread;
+    if (spawn)
+    {
+        state.tasks++;
+        // the new thread gets an arena of its own, which is freed along with this one
+        Arena* leftArena = arena.make<Arena>();
+        leftThread = std::thread([&state, leftArena, ret, begin, half, depth]() {
+            ret->left = subdivide(state, *leftArena, begin, half, depth + 1);
+            state.threads--;
+        });
+    }
+    else
+    {
+        ret->left = subdivide(state, arena, begin, half, depth + 1);
+    }
+    ret->right = subdivide(state, arena, half, end, depth + 1);
+    if (leftThread.joinable())
+    {
+        leftThread.join();
+    }
+
+    return ret;
+}
+
+static BVHPrimitive makePrimitive(Object* object, uint32_t triangle, const Vector& minBound, const Vector& maxBound)
+{
+    BVHPrimitive prim;
+    prim.obj = object;
+    prim.triangle = triangle;
+    prim.minBound = minBound;
+    prim.maxBound = maxBound;
+    prim.centroid = (minBound + maxBound) * 0.5f;
+    return prim;
+}
+
+// the bounds of a sphere or instance
+static void objectBounds(const Object* object, Vector& minBound, Vector& maxBound)
+{
+    if (object->type == ObjectType::Sphere)
+    {
+        const float radius = ((const Sphere*)object)->radius;
+        const glm::vec3& pos = ((const Sphere*)object)->position;
+
+        minBound = Vector(pos.x - radius, pos.y - radius, pos.z - radius);
+        maxBound = Vector(pos.x + radius, pos.y + radius, pos.z + radius);
+    }
+    else if (object->type == ObjectType::Instance)
+    {
+        // its mesh has a BVH of its own; this tree only needs the placed bounds
+        minBound = ((const Instance*)object)->boundsMin;
+        maxBound = ((const Instance*)object)->boundsMax;
+    }
+}
+
+static void triangleBounds(const Triangle& triangle, Vector& minBound, Vector& maxBound)
+{
+    minBound = glm::min(glm::min(triangle.vertices[0], triangle.vertices[1]), triangle.vertices[2]);
+    maxBound = glm::max(glm::max(triangle.vertices[0], triangle.vertices[1]), triangle.vertices[2]);
+}
+
+static BVHNode* buildTree(const std::vector<Object*>& objects, const BVHBuildOptions& options, Arena& arena, BVHBuildStats* stats)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    std::vector<BVHPrimitive> primitives;
+    size_t count = 0;
+    for (auto object : objects)
+    {
+        if (object->type == ObjectType::Sphere || object->type == ObjectType::Instance)
+        {
+            count++;
+        }
+        else if (object->type == ObjectType::Mesh)
+        {
+            count += ((Mesh*)object)->triangleCount();
+        }
+    }
+    primitives.reserve(count);
+
+    // filter and calculate per-object bounding box
+    for (auto object : objects)
+    {
+        Vector minBound, maxBound;
+        if (object->type == ObjectType::Sphere || object->type == ObjectType::Instance)
+        {
+            objectBounds(object, minBound, maxBound);
+            primitives.push_back(makePrimitive(object, NOT_A_TRIANGLE, minBound, maxBound));
+        }
+        else if (object->type == ObjectType::Mesh)
+        {
+            Mesh* mesh = (Mesh*)(object);
+
+            for (size_t i = 0; i < mesh->triangleCount(); i++)
+            {
+                triangleBounds(mesh->triangle(i), minBound, maxBound);
+                primitives.push_back(makePrimitive(mesh, (uint32_t)i, minBound, maxBound));
+            }
+        }
+    }
+    // e.g. a scene made only of planes
+    if (primitives.empty())
+    {
+        return NULL;
+    }
+
+    std::vector<uint32_t> indices(primitives.size());
+    for (size_t i = 0; i < indices.size(); i++)
+    {
+        indices[i] = (uint32_t)i;
+    }
+
+    int maxThreads = options.threads > 0 ? options.threads : (int)std::thread::hardware_concurrency();
+    BVHBuildState state(primitives, options, std::max(1, maxThreads));
+    BVHNode* root = subdivide(state, arena, indices.data(), indices.data() + indices.size(), 0);
+
+    if (stats != NULL)
+    {
+        stats->ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        stats->threads = state.maxThreads;
+        stats->tasks = state.tasks;
+        stats->primitives = primitives.size();
+        // everything above is alive at once just before it returns
+        stats->peakBytes = primitives.capacity() * sizeof(BVHPrimitive) + indices.capacity() * sizeof(uint32_t)
+            + state.nodes * sizeof(BVHNode) + state.leafObjects * sizeof(TriangleRef);
+    }
+    return root;
+}
+
+BVHNode* buildBVH(const std::vector<Object*>& objects, Arena& arena, const BVHBuildOptions& options)
+{
+    return buildTree(objects, options, arena, NULL);
+}
+
+// depth-first: a node's left child goes straight after it, its right child after the whole left subtree
+// meshIndex maps each mesh seen so far to its index in linear.triangles.meshes
+static uint32_t flattenNode(const BVHNode* node, LinearBVH& linear, std::unordered_map<const Mesh*, uint32_t>& meshIndex)
+{
+    const uint32_t index = (uint32_t)linear.nodes.size();
+    linear.nodes.push_back(LinearBVHNode());
+    LinearBVHNode& flat = linear.nodes.back();
+    flat.aabbMinBound = node->aabbMinBound;
+    flat.aabbMaxBound = node->aabbMaxBound;
+
+    flat.leafTriangles = 0;
+    if (!node->objects.empty())
+    {
+        flat.offset = (uint32_t)linear.objects.size();
+        flat.objectCount = (uint16_t)node->objects.size();
+        linear.objects.insert(linear.objects.end(), node->objects.begin(), node->objects.end());
+        return index;
+    }
+    if (!node->triangles.empty())
+    {
+        flat.offset = (uint32_t)linear.triangles.size();
+        flat.objectCount = (uint16_t)node->triangles.size();
+        flat.leafTriangles = 1;
+        for (auto& ref : node->triangles)
+        {
+            auto found = meshIndex.find(ref.mesh);
+            if (found == meshIndex.end())
+            {
+                found = meshIndex.insert({ ref.mesh, linear.triangles.addMesh(ref.mesh) }).first;
+            }
+            linear.triangles.add(found->second, ref.index, ref.mesh->triangle(ref.index));
+        }
+        return index;
+    }
+
+    flat.objectCount = 0;
+    flat.axis = (uint8_t)node->axis;
+    flattenNode(node->left, linear, meshIndex);
+    // push_back above may have moved the array, so don't hold on to flat
+    uint32_t right = flattenNode(node->right, linear, meshIndex);
+    linear.nodes[index].offset = right;
+    return index;
+}
+
+LinearBVH flattenBVH(const BVHNode* root)
+{
+    LinearBVH linear;
+    if (root != NULL)
+    {
+        std::unordered_map<const Mesh*, uint32_t> meshIndex;
+        flattenNode(root, linear, meshIndex);
+    }
+    linear.triangles.pad();
+    return linear;
+}
+
+LinearBVH buildLinearBVH(const std::vector<Object*>& objects, const BVHBuildOptions& options)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    BVHBuildStats stats;
+    Arena arena;
+    BVHNode* root = buildTree(objects, options, arena, &stats);
+    LinearBVH linear = flattenBVH(root);
+    arena.clear();
+    stats.ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    // the flattened copy exists alongside the pointer tree until the tree is freed
+    stats.peakBytes += linear.nodes.capacity() * sizeof(LinearBVHNode) + linear.objects.capacity() * sizeof(Object*) + linear.triangles.bytes();
+    linear.build = stats;
+    linear.build.sahCost = bvhStats(linear).sahCost;
+    return linear;
+}
+
+static float nodeArea(const LinearBVHNode& node)
+{
+    return surfaceArea(node.aabbMinBound, node.aabbMaxBound);
+}
+
+static uint32_t collapseNode(const LinearBVH& bvh, uint32_t index, WideBVH& wide)
+{
+    // start from the binary node's two children (or the node itself, for a root leaf) and keep
+    // opening the interior child with the largest surface area, which is the likeliest to be hit
+    std::vector<uint32_t> children;
+    const LinearBVHNode& node = bvh.nodes[index];
+    if (node.objectCount > 0)
+    {
+        children.push_back(index);
+    }
+    else
+    {
+        children.push_back(index + 1);
+        children.push_back(node.offset);
+    }
+    while (children.size() < (size_t)BVH_WIDE)
+    {
+        int open = -1;
+        for (size_t i = 0; i < children.size(); i++)
+        {
+            const LinearBVHNode& child = bvh.nodes[children[i]];
+            if (child.objectCount == 0 && (open < 0 || nodeArea(child) > nodeArea(bvh.nodes[children[open]])))
+            {
+                open = (int)i;
+            }
+        }
+        if (open < 0)
+        {
+            break;
+        }
+        // replace it with its children in place, so the slots stay in the binary tree's left-to-right order
+        const uint32_t opened = children[open];
+        children[open] = opened + 1;
+        children.insert(children.begin() + open + 1, bvh.nodes[opened].offset);
+    }
+
+    const uint32_t wideIndex = (uint32_t)wide.nodes.size();
+    wide.nodes.push_back(WideBVHNode());
+    WideBVHNode& flat = wide.nodes.back();
+    for (int i = 0; i < BVH_WIDE; i++)
+    {
+        flat.minX[i] = flat.minY[i] = flat.minZ[i] = float(1e30f);
+        flat.maxX[i] = flat.maxY[i] = flat.maxZ[i] = float(-1e30f);
+        flat.child[i] = 0;
+        flat.objectCount[i] = 0;
+    }
+    flat.childCount = (uint8_t)children.size();
+    flat.triangleLeaves = 0;
+    for (size_t i = 0; i < children.size(); i++)
+    {
+        const LinearBVHNode& child = bvh.nodes[children[i]];
+        flat.minX[i] = child.aabbMinBound.x;
+        flat.minY[i] = child.aabbMinBound.y;
+        flat.minZ[i] = child.aabbMinBound.z;
+        flat.maxX[i] = child.aabbMaxBound.x;
+        flat.maxY[i] = child.aabbMaxBound.y;
+        flat.maxZ[i] = child.aabbMaxBound.z;
+        flat.objectCount[i] = child.objectCount;
+        flat.child[i] = child.offset;
+        if (child.objectCount > 0 && child.leafTriangles)
+        {
+            flat.triangleLeaves |= 1 << i;
+        }
+    }
+
+    // as in flattenNode(), collapsing the children may move the array
+    for (size_t i = 0; i < children.size(); i++)
+    {
+        if (bvh.nodes[children[i]].objectCount == 0)
+        {
+            uint32_t collapsed = collapseNode(bvh, children[i], wide);
+            wide.nodes[wideIndex].child[i] = collapsed;
+        }
+    }
+    return wideIndex;
+}
+
+WideBVH collapseBVH(const LinearBVH& bvh)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    WideBVH wide;
+    if (!bvh.empty())
+    {
+        collapseNode(bvh, 0, wide);
+    }
+    wide.objects = bvh.objects;
+    wide.triangles = bvh.triangles;
+    wide.build = bvh.build;
+    wide.build.ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    // the binary tree is still alive while the wide one is built
+    wide.build.peakBytes = std::max(wide.build.peakBytes, bvh.nodes.size() * sizeof(LinearBVHNode) + bvh.objects.size() * sizeof(Object*)
+        + bvh.triangles.bytes() + wide.nodes.capacity() * sizeof(WideBVHNode) + wide.objects.capacity() * sizeof(Object*) + wide.triangles.bytes());
+    // visiting a wide node costs one step for all its children, so its cost isn't the binary tree's
+    wide.build.sahCost = bvhStats(wide).sahCost;
+    return wide;
+}
+
+static void accumulateStats(const LinearBVH& bvh, uint32_t index, int depth, float rootArea, BVHStats& stats)
+{
+    const LinearBVHNode& node = bvh.nodes[index];
+    stats.depth = std::max(stats.depth, depth);
+    float relativeArea = surfaceArea(node.aabbMinBound, node.aabbMaxBound) / rootArea;
+    if (node.objectCount > 0)
+    {
+        stats.leaves++;
+        stats.sahCost += relativeArea * leafCost(node.objectCount, node.leafTriangles != 0);
+        return;
+    }
+    stats.sahCost += relativeArea * BVH_TRAVERSAL_COST;
+    accumulateStats(bvh, index + 1, depth + 1, rootArea, stats);
+    accumulateStats(bvh, node.offset, depth + 1, rootArea, stats);
+}
+
+BVHStats bvhStats(const LinearBVH& bvh)
+{
+    BVHStats stats;
+    if (!bvh.empty())
+    {
+        float rootArea = surfaceArea(bvh.nodes[0].aabbMinBound, bvh.nodes[0].aabbMaxBound);
+        accumulateStats(bvh, 0, 1, rootArea > 0.0f ? rootArea : 1.0f, stats);
+    }
+    stats.nodes = (int)bvh.nodes.size();
+    stats.bytes = bvh.nodes.size() * sizeof(LinearBVHNode) + bvh.objects.size() * sizeof(Object*);
+    stats.triangles = bvh.triangles.size();
+    stats.triangleBytes = bvh.triangles.bytes();
+    // the same tree as individually allocated BVHNodes (not counting allocator overhead)
+    stats.linkedBytes = bvh.nodes.size() * sizeof(BVHNode) + bvh.objects.size() * sizeof(Object*);
+    return stats;
+}
+
+static float wideChildArea(const WideBVHNode& node, int i)
+{
+    return surfaceArea(Vector(node.minX[i], node.minY[i], node.minZ[i]), Vector(node.maxX[i], node.maxY[i], node.maxZ[i]));
+}
+
+// here a node visit tests all of its children's boxes at once, so it costs one traversal step
+static void accumulateStats(const WideBVH& bvh, uint32_t index, int depth, float relativeArea, float rootArea, BVHStats& stats)
+{
+    const WideBVHNode& node = bvh.nodes[index];
+    stats.depth = std::max(stats.depth, depth);
+    stats.sahCost += relativeArea * BVH_TRAVERSAL_COST;
+    for (int i = 0; i < node.childCount; i++)
+    {
+        float childArea = wideChildArea(node, i) / rootArea;
+        if (node.objectCount[i] > 0)
+        {
+            stats.leaves++;
+            stats.depth = std::max(stats.depth, depth + 1);
+            stats.sahCost += childArea * leafCost(node.objectCount[i], (node.triangleLeaves & (1 << i)) != 0);
+        }
+        else
+        {
+            accumulateStats(bvh, node.child[i], depth + 1, childArea, rootArea, stats);
+        }
+    }
+}
+
+BVHStats bvhStats(const WideBVH& bvh)
+{
+    BVHStats stats;
+    if (!bvh.empty())
+    {
+        // the root's own box is the union of its children's
+        const WideBVHNode& root = bvh.nodes[0];
+        Vector minBound(float(1e30f), float(1e30f), float(1e30f));
+        Vector maxBound(float(-1e30f), float(-1e30f), float(-1e30f));
+        for (int i = 0; i < root.childCount; i++)
+        {
+            minBound = glm::min(minBound, Vector(root.minX[i], root.minY[i], root.minZ[i]));
+            maxBound = glm::max(maxBound, Vector(root.maxX[i], root.maxY[i], root.maxZ[i]));
+        }
+        float rootArea = surfaceArea(minBound, maxBound);
+        accumulateStats(bvh, 0, 1, 1.0f, rootArea > 0.0f ? rootArea : 1.0f, stats);
+    }
+    stats.nodes = (int)bvh.nodes.size();
+    stats.bytes = bvh.nodes.size() * sizeof(WideBVHNode) + bvh.objects.size() * sizeof(Object*);
+    stats.triangles = bvh.triangles.size();
+    stats.triangleBytes = bvh.triangles.bytes();
+    return stats;
+}
+
+// The bounds of a leaf's objects or triangles, found just as the builder found them
+static void leafBounds(const std::vector<Object*>& objects, const TriangleBuffer& triangles, bool leafTriangles, uint32_t first, int count,
+                       Vector& minBound, Vector& maxBound)
+{
+    minBound = Vector(float(1e30f), float(1e30f), float(1e30f));
+    maxBound = Vector(float(-1e30f), float(-1e30f), float(-1e30f));
+    for (uint32_t i = first; i < first + (uint32_t)count; i++)
+    {
+        Vector lo, hi;
+        if (leafTriangles)
+        {
+            triangleBounds(triangles.owner(i)->triangle(triangles.index[i]), lo, hi);
+        }
+        else
+        {
+            objectBounds(objects[i], lo, hi);
+        }
+        minBound = glm::min(minBound, lo);
+        maxBound = glm::max(maxBound, hi);
+    }
+}
+
+static float costGrowth(float sahCost, const BVHBuildStats& build)
+{
+    return build.sahCost > 0.0f ? sahCost / build.sahCost : 1.0f;
+}
+
+float refitBVH(LinearBVH& bvh)
+{
+    if (bvh.empty())
+    {
+        return 1.0f;
+    }
+    for (uint32_t i = 0; i < (uint32_t)bvh.triangles.size(); i++)
+    {
+        bvh.triangles.update(i);
+    }
+    // nodes are depth first, so every node's children come after it and going backwards reaches them first
+    for (size_t i = bvh.nodes.size(); i-- > 0;)
+    {
+        LinearBVHNode& node = bvh.nodes[i];
+        if (node.objectCount > 0)
+        {
+            leafBounds(bvh.objects, bvh.triangles, node.leafTriangles != 0, node.offset, node.objectCount, node.aabbMinBound, node.aabbMaxBound);
+            continue;
+        }
+        const LinearBVHNode& left = bvh.nodes[i + 1];
+        const LinearBVHNode& right = bvh.nodes[node.offset];
+        node.aabbMinBound = glm::min(left.aabbMinBound, right.aabbMinBound);
+        node.aabbMaxBound = glm::max(left.aabbMaxBound, right.aabbMaxBound);
+    }
+    return costGrowth(bvhStats(bvh).sahCost, bvh.build);
+}
+
+float refitBVH(WideBVH& bvh)
+{
+    if (bvh.empty())
+    {
+        return 1.0f;
+    }
+    for (uint32_t i = 0; i < (uint32_t)bvh.triangles.size(); i++)
+    {
+        bvh.triangles.update(i);
+    }
+    // collapseBVH() adds a node before any of its children, so the same backwards pass works here;
+    // an interior child's box is the union of that node's (already refit) children
+    for (size_t i = bvh.nodes.size(); i-- > 0;)
+    {
+        WideBVHNode& node = bvh.nodes[i];
+        for (int c = 0; c < node.childCount; c++)
+        {
+            Vector minBound, maxBound;
+            if (node.objectCount[c] > 0)
+            {
+                leafBounds(bvh.objects, bvh.triangles, (node.triangleLeaves & (1 << c)) != 0, node.child[c], node.objectCount[c], minBound, maxBound);
+            }
+            else
+            {
+                const WideBVHNode& child = bvh.nodes[node.child[c]];
+                minBound = Vector(float(1e30f), float(1e30f), float(1e30f));
+                maxBound = Vector(float(-1e30f), float(-1e30f), float(-1e30f));
+                for (int g = 0; g < child.childCount; g++)
+                {
+                    minBound = glm::min(minBound, Vector(child.minX[g], child.minY[g], child.minZ[g]));
+                    maxBound = glm::max(maxBound, Vector(child.maxX[g], child.maxY[g], child.maxZ[g]));
+                }
+            }
+            node.minX[c] = minBound.x;
+            node.minY[c] = minBound.y;
+            node.minZ[c] = minBound.z;
+            node.maxX[c] = maxBound.x;
+            node.maxY[c] = maxBound.y;
+            node.maxZ[c] = maxBound.z;
+        }
+    }
+    return costGrowth(bvhStats(bvh).sahCost, bvh.build);
+}
@@ -1,5 +1,132 @@
-#pragma once
-
-#include "schema.h"
-
-BVHNode* buildBVH(const std::vector<Object*>& objects);
+#pragma once
+
+#include "schema.h"
+#include "triangles.h"
+
+// Trees are never deeper than this, so traversal can use a fixed-size stack
+const int BVH_MAX_DEPTH = 64;
+
+// Relative costs of visiting a node and of testing an object (or a group of TRIANGLE_LANES
+// triangles), used by the SAH and to decide when a range is cheaper to test as a leaf than to split
+const float BVH_TRAVERSAL_COST = 1.0f;
+const float BVH_INTERSECT_COST = 1.0f;
+
+// LinearBVHNode::objectCount is 16 bits
+const int BVH_MAX_LEAF_SIZE = 65535;
+
+// Children per node of the wide BVH
+const int BVH_WIDE = 4;
+
+// A refit tree is rebuilt once its SAH cost is this many times what it was when built
+const float BVH_REBUILD_RATIO = 1.5f;
+
+enum class BVHBuilder : uint8_t {
+    Median,     // split at the object median along the longest axis
+    SAH         // binned surface area heuristic
+};
+
+enum class BVHLayout : uint8_t {
+    Binary,     // LinearBVH: two children per node, one box test at a time
+    Wide        // WideBVH: the binary tree collapsed to BVH_WIDE children per node, tested together
+};
+
+struct BVHBuildOptions {
+    BVHBuilder builder;
+    BVHLayout layout;
+    int sahBins;        // candidate split planes per axis are between these bins
+    int maxLeafSize;    // ranges up to this size become leaves when the cost model says splitting doesn't pay
+    int threads;        // subtrees are built on up to this many threads; 0 means one per hardware thread
+
+    BVHBuildOptions() : builder(BVHBuilder::SAH), layout(BVHLayout::Wide), sahBins(16), maxLeafSize(4), threads(0) {}
+};
+
+// How a build went, filled in by buildLinearBVH()
+struct BVHBuildStats {
+    double ms;
+    int threads;            // the most threads the build was allowed
+    int tasks;              // subtrees that were built on another thread
+    size_t primitives;      // spheres and triangles in the tree
+    size_t peakBytes;       // the builder's own working memory at its largest, not counting the scene
+    float sahCost;          // BVHStats::sahCost of the tree as built, which refitBVH() compares against
+
+    BVHBuildStats() : ms(0), threads(0), tasks(0), primitives(0), peakBytes(0), sahCost(0) {}
+};
+
+struct BVHStats {
+    int nodes;
+    int leaves;
+    int depth;
+    // expected cost of a ray through the tree: node visits and object tests, each weighted by
+    // the node's surface area relative to the root's; lower is better
+    float sahCost;
+    size_t bytes;           // nodes plus the leaf object list
+    size_t linkedBytes;     // what the nodes take as a pointer-linked BVHNode tree
+    size_t triangles;
+    size_t triangleBytes;   // the TriangleBuffer
+
+    BVHStats() : nodes(0), leaves(0), depth(0), sahCost(0), bytes(0), linkedBytes(0), triangles(0), triangleBytes(0) {}
+};
+
+// One node of a flattened BVH. Nodes are stored depth first, so an interior node's left child
+// is the next node in the array and only the right child needs an index.
+struct LinearBVHNode {
+    Vector aabbMinBound;
+    uint32_t offset;        // leaf: first of its objects (or triangles); interior: index of the right child
+    Vector aabbMaxBound;
+    uint16_t objectCount;   // objects or triangles in a leaf, 0 for interior nodes
+    uint8_t axis;           // interior: axis the children were split along
+    uint8_t leafTriangles;  // leaf: 1 if it holds triangles from LinearBVH::triangles rather than objects
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
+
+struct LinearBVH {
+    std::vector<LinearBVHNode> nodes;
+    std::vector<Object*> objects;   // leaf objects (spheres), in the order their leaves appear in nodes
+    TriangleBuffer triangles;       // leaf triangles, likewise
+    BVHBuildStats build;
+
+    bool empty() const { return nodes.empty(); }
+};
+
+// One node of a wide BVH. The children's bounds are stored one axis at a time (structure of
+// arrays) so a single SIMD slab test covers every child. Unused slots have empty bounds.
+struct alignas(16) WideBVHNode {
+    float minX[BVH_WIDE], maxX[BVH_WIDE];
+    float minY[BVH_WIDE], maxY[BVH_WIDE];
+    float minZ[BVH_WIDE], maxZ[BVH_WIDE];
+    uint32_t child[BVH_WIDE];           // leaf child: first of its objects or triangles; interior child: its node index
+    uint16_t objectCount[BVH_WIDE];     // 0 for interior children
+    uint8_t childCount;
+    uint8_t triangleLeaves;             // bit i is set if child i is a leaf of triangles rather than objects
+    uint8_t pad[6];
+};
+static_assert(sizeof(WideBVHNode) == 128, "WideBVHNode should fill two cache lines");
+
+struct WideBVH {
+    std::vector<WideBVHNode> nodes;     // the root is nodes[0]
+    std::vector<Object*> objects;       // leaf objects, in the same order as the LinearBVH's
+    TriangleBuffer triangles;           // and leaf triangles
+    BVHBuildStats build;
+
+    bool empty() const { return nodes.empty(); }
+};
+
+// Returns NULL if there are no bounded objects (spheres, meshes or instances) to put in the tree.
+// Large subtrees are built concurrently, see BVHBuildOptions::threads. The nodes are made in
+// arena (and arenas it owns), so clearing or destroying it frees the whole tree.
+BVHNode* buildBVH(const std::vector<Object*>& objects, Arena& arena, const BVHBuildOptions& options = BVHBuildOptions());
+LinearBVH flattenBVH(const BVHNode* root);
+// buildBVH() then flattenBVH(), freeing the intermediate tree
+LinearBVH buildLinearBVH(const std::vector<Object*>& objects, const BVHBuildOptions& options = BVHBuildOptions());
+// Collapse a binary BVH into a wide one: each node takes the children of its largest
+// interior children until it has BVH_WIDE of them. Leaves are kept as they are.
+WideBVH collapseBVH(const LinearBVH& bvh);
+BVHStats bvhStats(const LinearBVH& bvh);
+BVHStats bvhStats(const WideBVH& bvh);
+// After the tree's objects have moved (spheres, instances with new bounds, or mesh vertices;
+// none added or removed), copy its triangles again and recompute every node's bounds bottom up,
+// keeping the tree's shape. Much cheaper than a rebuild, but the tree gets worse the further
+// things move from where it was built for: returns its SAH cost over build.sahCost, and once
+// that passes BVH_REBUILD_RATIO or so it's time to build it again.
+float refitBVH(LinearBVH& bvh);
+float refitBVH(WideBVH& bvh);
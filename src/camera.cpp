@@ -0,0 +1,54 @@
+#include "camera.h"
+
+#include <cmath>
+
+const double CAMERA_PI = 3.1415926535897932384626433832795;
+
+static void viewPlaneExtent(const View& view, float& w, float& h) {
+    float aspect_ratio = (float)view.width / view.height;
+    h = view.d * (float)tan((CAMERA_PI * fov) / 180.0 / 2.0);
+    w = h * aspect_ratio;
+}
+
+point3 viewPlanePoint(const View& view, int x, int y) {
+    float w, h;
+    viewPlaneExtent(view, w, h);
+
+    float top = h;
+    float bottom = -h;
+    float left = -w;
+    float right = w;
+
+    float u = left + (right - left) * (x + view.lookAt.x + 0.5f) / view.width;
+    float v = bottom + (top - bottom) * (y + view.lookAt.y + 0.5f) / view.height;
+
+    return point3(u, v, -view.d + view.lookAt.z);
+}
+
+ViewPlaneSamples viewPlaneSamples(const View& view, int x, int y, ShadingMode mode) {
+    float w, h;
+    viewPlaneExtent(view, w, h);
+
+    float top = h;
+    float bottom = -h;
+    float left = -w;
+    float right = w;
+
+    float offset = 0.25f;
+    if (toonShading(mode)) {
+        offset = 1.0f;
+    }
+
+    const float z = -view.d + view.lookAt.z;
+    ViewPlaneSamples result;
+    //top left
+    result[0] = Vector(left + (right - left) * (x + view.lookAt.x + 0.5f - offset) / view.width, bottom + (top - bottom) * (y + view.lookAt.y + 0.5f + offset) / view.height, z);
+    //top right
+    result[1] = Vector(left + (right - left) * (x + view.lookAt.x + 0.5f + offset) / view.width, bottom + (top - bottom) * (y + view.lookAt.y + 0.5f + offset) / view.height, z);
+    //bottom left
+    result[2] = Vector(left + (right - left) * (x + view.lookAt.x + 0.5f - offset) / view.width, bottom + (top - bottom) * (y + view.lookAt.y + 0.5f - offset) / view.height, z);
+    //bottom right
+    result[3] = Vector(left + (right - left) * (x + view.lookAt.x + 0.5f + offset) / view.width, bottom + (top - bottom) * (y + view.lookAt.y + 0.5f - offset) / view.height, z);
+
+    return result;
+}
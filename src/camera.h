@@ -0,0 +1,22 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include "raytracer.h"
+
+// Describes how pixels of a width x height image map onto the view plane.
+// lookFrom is the eye; lookAt shifts the view plane (x/y in pixels, z in world units).
+struct View {
+    int width;
+    int height;
+    point3 lookFrom;
+    point3 lookAt;
+    float d;
+
+    View() : width(0), height(0), lookFrom(0, 0, 0), lookAt(0, 0, 0), d(1) {}
+    View(int _width, int _height) : width(_width), height(_height), lookFrom(0, 0, 0), lookAt(0, 0, 0), d(1) {}
+};
+
+// centre of pixel (x, y) on the view plane
+point3 viewPlanePoint(const View& view, int x, int y);
+// four supersampling positions around pixel (x, y), in the order ssTrace() expects
+ViewPlaneSamples viewPlaneSamples(const View& view, int x, int y, ShadingMode mode = ShadingMode::Final);
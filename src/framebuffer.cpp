@@ -0,0 +1,46 @@
+#include "framebuffer.h"
+
+#include <fstream>
+#include <glm/glm.hpp>
+
+colour3 renderPixel(const View& view, bool antialias, ShadingMode mode, int x, int y) {
+    colour3 colour;
+    Rng rng = Rng::forPixel(x, y);
+    bool hit;
+    if (antialias) {
+        hit = ssTrace(view.lookFrom, viewPlaneSamples(view, x, y, mode), colour, rng, false, mode);
+    }
+    else {
+        hit = trace(view.lookFrom, viewPlanePoint(view, x, y), colour, rng, false, mode);
+    }
+    return hit ? colour : background_colour;
+}
+
+void renderFrame(const View& view, bool antialias, ShadingMode mode, Framebuffer& fb) {
+    for (int y = 0; y < fb.height; y++) {
+        for (int x = 0; x < fb.width; x++) {
+            fb.at(x, y) = renderPixel(view, antialias, mode, x, y);
+        }
+    }
+}
+
+bool writePPM(const Framebuffer& fb, const std::string& fn) {
+    std::ofstream out(fn.c_str(), std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+
+    out << "P6\n" << fb.width << " " << fb.height << "\n255\n";
+    std::vector<unsigned char> row(fb.width * 3);
+    // PPM stores the top scanline first
+    for (int y = fb.height - 1; y >= 0; y--) {
+        for (int x = 0; x < fb.width; x++) {
+            colour3 c = glm::clamp(fb.at(x, y), 0.0f, 1.0f);
+            row[x * 3 + 0] = (unsigned char)(c.r * 255.0f + 0.5f);
+            row[x * 3 + 1] = (unsigned char)(c.g * 255.0f + 0.5f);
+            row[x * 3 + 2] = (unsigned char)(c.b * 255.0f + 0.5f);
+        }
+        out.write((const char*)row.data(), row.size());
+    }
+    return out.good();
+}
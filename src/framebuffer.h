@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "raytracer.h"
+#include "camera.h"
+
+// In-memory image; row 0 is the bottom scanline, matching the view plane (and q1.cpp's drawing order).
+struct Framebuffer {
+    int width;
+    int height;
+    std::vector<colour3> pixels;
+
+    Framebuffer(int _width, int _height) : width(_width), height(_height), pixels(_width * _height) {}
+
+    colour3& at(int x, int y) { return pixels[y * width + x]; }
+    const colour3& at(int x, int y) const { return pixels[y * width + x]; }
+};
+
+// trace a single pixel, falling back to the background colour on a miss
+colour3 renderPixel(const View& view, bool antialias, ShadingMode mode, int x, int y);
+// trace every pixel of the frame into fb (fb must match view's size)
+void renderFrame(const View& view, bool antialias, ShadingMode mode, Framebuffer& fb);
+// write fb as a binary PPM (P6); returns false if the file could not be written
+bool writePPM(const Framebuffer& fb, const std::string& fn);
@@ -5,11 +5,14 @@
 #include <fstream>
 #include <string>
 #include <cstdio>
+#include <cstring>
+#include <unordered_map>
 #include <glm/glm.hpp>
 
 #include "schema.h"
 
 #include "json2schema.h"
+#include "meshfile.h"
 
 using json = nlohmann::json;
 
@@ -19,7 +22,114 @@ static glm::vec3 vector_to_vec3(const std::vector<float> &v) {
 	return glm::vec3(v[0], v[1], v[2]);
 }
 
-int json_to_scene(json &jscene, Scene &s) {
+// Find m in the scene's material table, adding it if it is new. False if the table is full.
+static bool add_material(Scene &s, const Material &m, std::unordered_map<std::string, MaterialIndex> &index, MaterialIndex &mi) {
+  // every Material member is a float, so there is no padding and equal materials have equal bytes
+  std::string key(sizeof(Material), '\0');
+  memcpy(&key[0], &m, sizeof(Material));
+  auto found = index.find(key);
+  if (found != index.end()) {
+    mi = found->second;
+    return true;
+  }
+  if (s.materials.size() > UINT16_MAX) {
+    return false;
+  }
+  mi = (MaterialIndex)s.materials.size();
+  s.materials.push_back(m);
+  index[key] = mi;
+  return true;
+}
+
+// Builds an indexed mesh from a list of triangles, storing each distinct vertex once. Vertices
+// only match if their bits do, so the triangles come out exactly as they were given.
+struct MeshIndexer {
+  struct Bits {
+    size_t operator()(const Vertex &v) const {
+      uint32_t b[3];
+      memcpy(b, &v[0], sizeof(b));
+      return (size_t)b[0] * 73856093u ^ (size_t)b[1] * 19349663u ^ (size_t)b[2] * 83492791u;
+    }
+    bool operator()(const Vertex &a, const Vertex &b) const {
+      return memcmp(&a[0], &b[0], 3 * sizeof(float)) == 0;
+    }
+  };
+
+  std::vector<Vertex> vertices;
+  std::vector<uint32_t> indices;
+  std::unordered_map<Vertex, uint32_t, Bits, Bits> index;
+
+  void add(const Triangle &t) {
+    for (const Vertex &v : t.vertices) {
+      auto found = index.insert({ v, (uint32_t)vertices.size() });
+      if (found.second) {
+        vertices.push_back(v);
+      }
+      indices.push_back(found.first->second);
+    }
+  }
+};
+
+// mesh files are named relative to the scene's directory, unless the path is absolute
+static std::string mesh_path(const std::string &dir, const std::string &file) {
+  return !file.empty() && file[0] == '/' ? file : dir + file;
+}
+
+// All of a material's parameters are optional
+static Material json_to_material(json &material) {
+  Material m;
+  if (material.find("ambient") != material.end()) {
+    m.ambient = vector_to_vec3(material["ambient"]);
+  }
+  if (material.find("diffuse") != material.end()) {
+    m.diffuse = vector_to_vec3(material["diffuse"]);
+  }
+  if (material.find("specular") != material.end()) {
+    m.specular = vector_to_vec3(material["specular"]);
+  }
+  if (material.find("shininess") != material.end()) {
+    m.shininess = material["shininess"];
+  }
+  if (material.find("reflective") != material.end()) {
+    m.reflective = vector_to_vec3(material["reflective"]);
+  }
+  if (material.find("transmissive") != material.end()) {
+    m.transmissive = vector_to_vec3(material["transmissive"]);
+  }
+  if (material.find("refraction") != material.end()) {
+    m.refraction = material["refraction"];
+  }
+  return m;
+}
+
+// Every mesh has either a list of triangles or a model file (OBJ or PLY) to read them from
+static Mesh *json_to_mesh(json &object, const std::string &dir, MaterialIndex mi, Scene &s) {
+  MeshIndexer mesh;
+  if (object.find("file") != object.end()) {
+    MeshTransform transform;
+    if (object.find("scale") != object.end()) {
+      transform.scale = object["scale"];
+    }
+    if (object.find("rotate") != object.end()) {
+      transform.rotate = vector_to_vec3(object["rotate"]);
+    }
+    if (object.find("translate") != object.end()) {
+      transform.translate = vector_to_vec3(object["translate"]);
+    }
+    if (!loadMeshFile(mesh_path(dir, object["file"]), transform, mesh.vertices, mesh.indices)) {
+      return NULL;
+    }
+  } else {
+    json &ts = object["triangles"];
+    for (json::iterator ti = ts.begin(); ti != ts.end(); ++ti) {
+      json &t = *ti;
+      mesh.add( { { vector_to_vec3(t[0]), vector_to_vec3(t[1]), vector_to_vec3(t[2]) } } );
+    }
+  }
+  return s.arena.make<Mesh>(mi, std::move(mesh.vertices), std::move(mesh.indices));
+}
+
+int json_to_scene(json &jscene, Scene &s, const std::string &dir) {
   json camera = jscene["camera"];
   if (camera.find("field") != camera.end()) {
     s.camera.field = camera["field"];
@@ -28,34 +138,41 @@ int json_to_scene(json &jscene, Scene &s) {
     s.camera.background = vector_to_vec3(camera["background"]);
   }
 
+  // Identical materials are stored once, keyed on their bytes
+  std::unordered_map<std::string, MaterialIndex> material_index;
+
+  // Meshes that instances share, by name
+  std::unordered_map<std::string, uint32_t> shared_meshes;
+  if (jscene.find("meshes") != jscene.end()) {
+    json &meshes = jscene["meshes"];
+    for (json::iterator it = meshes.begin(); it != meshes.end(); ++it) {
+      MaterialIndex mi;
+      if (!add_material(s, json_to_material(it.value()["material"]), material_index, mi)) {
+        std::cout << "*** too many distinct materials\n";
+        return -1;
+      }
+      Mesh *mesh = json_to_mesh(it.value(), dir, mi, s);
+      if (mesh == NULL) {
+        return -1;
+      }
+      shared_meshes[it.key()] = (uint32_t)s.meshes.size();
+      s.meshes.push_back(mesh);
+    }
+  }
+
   // Traverse the objects
   json &objects = jscene["objects"];
   for (json::iterator it = objects.begin(); it != objects.end(); ++it) {
     json &object = *it;
 
-    // Every object will have a material, but all parameters are optional
-    json &material = object["material"];
-    Material m;
-    if (material.find("ambient") != material.end()) {
-      m.ambient = vector_to_vec3(material["ambient"]);
-    }
-    if (material.find("diffuse") != material.end()) {
-      m.diffuse = vector_to_vec3(material["diffuse"]);
-    }
-    if (material.find("specular") != material.end()) {
-      m.specular = vector_to_vec3(material["specular"]);
-    }
-    if (material.find("shininess") != material.end()) {
-      m.shininess = material["shininess"];
-    }
-    if (material.find("reflective") != material.end()) {
-      m.reflective = vector_to_vec3(material["reflective"]);
-    }
-    if (material.find("transmissive") != material.end()) {
-      m.transmissive = vector_to_vec3(material["transmissive"]);
-    }
-    if (material.find("refraction") != material.end()) {
-      m.refraction = material["refraction"];
+    // Every object will have a material, but all parameters are optional. An instance without
+    // one takes its mesh's.
+    const bool has_material = object.find("material") != object.end();
+    Material m = json_to_material(object["material"]);
+    MaterialIndex mi = 0;
+    if ((has_material || object["type"] != "instance") && !add_material(s, m, material_index, mi)) {
+      std::cout << "*** too many distinct materials\n";
+      return -1;
     }
 
     // Every object in the scene will have a type
@@ -63,21 +180,40 @@ int json_to_scene(json &jscene, Scene &s) {
       // Every sphere has a position and a radius
       Vertex pos = vector_to_vec3(object["position"]);
       float radius = object["radius"];
-      s.objects.push_back(new Sphere(m, radius, pos));
+      s.objects.push_back(s.arena.make<Sphere>(mi, radius, pos));
     } else if (object["type"] == "plane") {
       // Every plane has a position (point of intersection) and a normal
       Vertex pos = vector_to_vec3(object["position"]);
       Vector normal = vector_to_vec3(object["normal"]);
-      s.objects.push_back(new Plane(m, pos, normal));
+      s.objects.push_back(s.arena.make<Plane>(mi, pos, normal));
     } else if (object["type"] == "mesh") {
-      // Every mesh has a list of triangles
-      std::vector<Triangle> tris;
-      json &ts = object["triangles"];
-      for (json::iterator ti = ts.begin(); ti != ts.end(); ++ti) {
-        json &t = *ti;
-        tris.push_back( { vector_to_vec3(t[0]), vector_to_vec3(t[1]), vector_to_vec3(t[2]) } );
+      Mesh *mesh = json_to_mesh(object, dir, mi, s);
+      if (mesh == NULL) {
+        return -1;
+      }
+      s.objects.push_back(mesh);
+    } else if (object["type"] == "instance") {
+      // Every instance places a mesh from "meshes", with an optional scale, rotation and translation
+      auto found = shared_meshes.find(object["mesh"].get<std::string>());
+      if (found == shared_meshes.end()) {
+        std::cout << "*** no mesh called " << object["mesh"] << " in meshes\n";
+        return -1;
+      }
+      MeshTransform place;
+      if (object.find("scale") != object.end()) {
+        place.scale = object["scale"];
+      }
+      if (object.find("rotate") != object.end()) {
+        place.rotate = vector_to_vec3(object["rotate"]);
       }
-      s.objects.push_back(new Mesh(m, tris));
+      if (object.find("translate") != object.end()) {
+        place.translate = vector_to_vec3(object["translate"]);
+      }
+      const Mesh &mesh = *s.meshes[found->second];
+      Instance *instance = s.arena.make<Instance>(has_material ? mi : mesh.material, found->second,
+        Transform::placement(place.scale, place.rotate, place.translate));
+      instance->bound(mesh);
+      s.objects.push_back(instance);
     } else {
       std::cout << "*** unrecognized object type " << object["type"] << "\n";
       return -1;
@@ -95,26 +231,26 @@ int json_to_scene(json &jscene, Scene &s) {
     if (light["type"] == "ambient") {
       // There should only be one ambient light
       for (Light *l : s.lights) {
-        if (l->type == "ambient") {
+        if (l->type == LightType::Ambient) {
           std::cout << "*** there should only be one ambient light!\n";
           return -1;
         }
       }
-      s.lights.push_back(new AmbientLight(colour));
+      s.lights.push_back(s.arena.make<AmbientLight>(colour));
     } else if (light["type"] == "directional") {
       // Every directional light has a direction
       Vector direction = vector_to_vec3(light["direction"]);
-      s.lights.push_back(new DirectionalLight(colour, direction));
+      s.lights.push_back(s.arena.make<DirectionalLight>(colour, direction));
     } else if (light["type"] == "point") {
       // Every point light has a position
       Vertex pos = vector_to_vec3(light["position"]);
-      s.lights.push_back(new PointLight(colour, pos));
+      s.lights.push_back(s.arena.make<PointLight>(colour, pos));
     } else if (light["type"] == "spot") {
       // Every spot light has a position, direction, and cutoff
       Vertex pos = vector_to_vec3(light["position"]);
       Vector direction = vector_to_vec3(light["direction"]);
       float cutoff = light["cutoff"];
-      s.lights.push_back(new SpotLight(colour, pos, direction, cutoff));
+      s.lights.push_back(s.arena.make<SpotLight>(colour, pos, direction, cutoff));
     } else {
       std::cout << "*** unrecognized light type " << light["type"] << "\n";
       return -1;
@@ -126,6 +262,437 @@ int json_to_scene(json &jscene, Scene &s) {
 
 /****************************************************************************/
 
+// Streams a scene file through the parser's SAX interface. Nothing is kept but the object or
+// light being read: its fields are written in place as the numbers arrive, and each mesh
+// triangle goes through a MeshIndexer as soon as its three vertices are read, which looks each
+// vertex up in a hash map and builds the mesh's vertices and indices. No DOM is built.
+class SceneSaxReader : public nlohmann::json_sax<json> {
+public:
+  SceneSaxReader(Scene &s, const std::string &dir) : s(s), dir(dir), skipDepth(0), next(Value::Skip),
+    vector(NULL), components(0), scalar(NULL), text(NULL), vertex(0) {}
+
+  bool null() override { return scalarValue(); }
+  bool boolean(bool) override { return scalarValue(); }
+  bool number_integer(number_integer_t val) override { return number((float)val); }
+  bool number_unsigned(number_unsigned_t val) override { return number((float)val); }
+  bool number_float(number_float_t val, const string_t &) override { return number((float)val); }
+
+  bool string(string_t &val) override {
+    if (skipDepth == 0 && !stack.empty() && !inArray() && next == Value::Text) {
+      *text = std::move(val);
+      return true;
+    }
+    return scalarValue();
+  }
+
+  bool key(string_t &val) override {
+    if (skipDepth == 0) {
+      expect(stack.back(), val);
+    }
+    return true;
+  }
+
+  bool start_object(std::size_t) override {
+    if (skipDepth > 0) {
+      skipDepth++;
+    } else if (stack.empty()) {
+      stack.push_back(Node::Root);
+    } else if (stack.back() == Node::Objects) {
+      object = PendingObject();
+      stack.push_back(Node::Object);
+    } else if (stack.back() == Node::Lights) {
+      light = PendingLight();
+      stack.push_back(Node::Light);
+    } else if (inArray()) {
+      return error("unexpected object");
+    } else if (next == Value::SharedMesh) {
+      object = PendingObject();
+      object.type = "mesh";
+      object.name = sharedName;
+      stack.push_back(Node::Object);
+    } else if (next == Value::Camera) {
+      stack.push_back(Node::Camera);
+    } else if (next == Value::Meshes) {
+      stack.push_back(Node::Meshes);
+    } else if (next == Value::Material) {
+      stack.push_back(Node::Material);
+    } else {
+      return skip();
+    }
+    return true;
+  }
+
+  bool end_object() override {
+    if (skipDepth > 0) {
+      skipDepth--;
+      return true;
+    }
+    Node node = stack.back();
+    stack.pop_back();
+    if (node == Node::Object) {
+      return addObject();
+    }
+    if (node == Node::Light) {
+      return addLight();
+    }
+    return true;
+  }
+
+  bool start_array(std::size_t) override {
+    if (skipDepth > 0) {
+      skipDepth++;
+    } else if (stack.empty()) {
+      return error("a scene is an object");
+    } else if (stack.back() == Node::Triangles) {
+      vertex = 0;
+      stack.push_back(Node::Triangle);
+    } else if (stack.back() == Node::Triangle) {
+      if (vertex == 3) {
+        return error("a triangle has more than three vertices");
+      }
+      startVector(&object.triangle.vertices[vertex++]);
+    } else if (inArray()) {
+      return error("unexpected array");
+    } else if (next == Value::Objects) {
+      stack.push_back(Node::Objects);
+    } else if (next == Value::Lights) {
+      stack.push_back(Node::Lights);
+    } else if (next == Value::Triangles) {
+      object.hasTriangles = true;
+      stack.push_back(Node::Triangles);
+    } else if (next == Value::Vector) {
+      startVector(vector);
+    } else {
+      return skip();
+    }
+    return true;
+  }
+
+  bool end_array() override {
+    if (skipDepth > 0) {
+      skipDepth--;
+      return true;
+    }
+    Node node = stack.back();
+    stack.pop_back();
+    if (node == Node::Vector && components != 3) {
+      return error("expected three numbers");
+    }
+    if (node == Node::Triangle) {
+      if (vertex != 3) {
+        return error("a triangle has fewer than three vertices");
+      }
+      object.mesh.add(object.triangle);
+    }
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &ex) override {
+    return error(ex.what());
+  }
+
+  // Once the whole file is read, point each instance at its mesh
+  bool finish() {
+    for (const PendingInstance &p : instances) {
+      auto found = sharedMeshes.find(p.mesh);
+      if (found == sharedMeshes.end()) {
+        return error("no mesh called \"" + p.mesh + "\" in meshes");
+      }
+      const Mesh &mesh = *s.meshes[found->second];
+      p.instance->mesh = found->second;
+      if (!p.hasMaterial) {
+        p.instance->material = mesh.material;
+      }
+      p.instance->bound(mesh);
+    }
+    return true;
+  }
+
+private:
+  // what the value being read belongs to
+  enum class Node { Root, Camera, Meshes, Objects, Object, Material, Lights, Light, Triangles, Triangle, Vector };
+  // what the current key says its value is
+  enum class Value { Skip, Camera, Meshes, SharedMesh, Objects, Lights, Material, Triangles, Text, Vector, Scalar };
+
+  // Every field is optional while reading; the ones a type needs are checked once its object ends
+  struct PendingObject {
+    std::string type;
+    std::string name;       // shared meshes: their key in "meshes"
+    std::string meshName;   // instances: the name of their shared mesh
+    Material material;
+    Vertex position;
+    Vector normal;
+    float radius;
+    Triangle triangle;    // the one being read
+    MeshIndexer mesh;
+    std::string file;
+    MeshTransform transform;
+    bool hasMaterial, hasPosition, hasNormal, hasRadius, hasTriangles;
+
+    PendingObject() : position(0), normal(0), radius(0),
+      hasMaterial(false), hasPosition(false), hasNormal(false), hasRadius(false), hasTriangles(false) {}
+  };
+
+  struct PendingLight {
+    std::string type;
+    RGB color;
+    Vertex position;
+    Vector direction;
+    float cutoff;
+    bool hasColor, hasPosition, hasDirection, hasCutoff;
+
+    PendingLight() : color(0), position(0), direction(0), cutoff(0),
+      hasColor(false), hasPosition(false), hasDirection(false), hasCutoff(false) {}
+  };
+
+  struct PendingInstance {
+    Instance *instance;
+    std::string mesh;
+    bool hasMaterial;
+  };
+
+  // Point next (and vector, scalar or text) at where the value of key name in node goes
+  void expect(Node node, const std::string &name) {
+    next = Value::Skip;
+    if (node == Node::Root) {
+      if (name == "camera") next = Value::Camera;
+      else if (name == "meshes") next = Value::Meshes;
+      else if (name == "objects") next = Value::Objects;
+      else if (name == "lights") next = Value::Lights;
+    } else if (node == Node::Meshes) {
+      next = Value::SharedMesh;
+      sharedName = name;
+    } else if (node == Node::Camera) {
+      if (name == "field") expectScalar(&s.camera.field);
+      else if (name == "background") expectVector(&s.camera.background);
+    } else if (node == Node::Object) {
+      if (name == "type") expectText(&object.type);
+      else if (name == "material") {
+        next = Value::Material;
+        object.hasMaterial = true;
+      }
+      else if (name == "position") expectVector(&object.position, &object.hasPosition);
+      else if (name == "normal") expectVector(&object.normal, &object.hasNormal);
+      else if (name == "radius") expectScalar(&object.radius, &object.hasRadius);
+      else if (name == "triangles") next = Value::Triangles;
+      else if (name == "file") expectText(&object.file);
+      else if (name == "mesh") expectText(&object.meshName);
+      else if (name == "scale") expectScalar(&object.transform.scale);
+      else if (name == "rotate") expectVector(&object.transform.rotate);
+      else if (name == "translate") expectVector(&object.transform.translate);
+    } else if (node == Node::Material) {
+      Material &m = object.material;
+      if (name == "ambient") expectVector(&m.ambient);
+      else if (name == "diffuse") expectVector(&m.diffuse);
+      else if (name == "specular") expectVector(&m.specular);
+      else if (name == "shininess") expectScalar(&m.shininess);
+      else if (name == "reflective") expectVector(&m.reflective);
+      else if (name == "transmissive") expectVector(&m.transmissive);
+      else if (name == "refraction") expectScalar(&m.refraction);
+    } else if (node == Node::Light) {
+      if (name == "type") expectText(&light.type);
+      else if (name == "color") expectVector(&light.color, &light.hasColor);
+      else if (name == "position") expectVector(&light.position, &light.hasPosition);
+      else if (name == "direction") expectVector(&light.direction, &light.hasDirection);
+      else if (name == "cutoff") expectScalar(&light.cutoff, &light.hasCutoff);
+    }
+  }
+
+  void expectVector(glm::vec3 *v, bool *has = NULL) {
+    next = Value::Vector;
+    vector = v;
+    if (has != NULL) *has = true;
+  }
+
+  void expectScalar(float *f, bool *has = NULL) {
+    next = Value::Scalar;
+    scalar = f;
+    if (has != NULL) *has = true;
+  }
+
+  void expectText(std::string *t) {
+    next = Value::Text;
+    text = t;
+  }
+
+  void startVector(glm::vec3 *v) {
+    vector = v;
+    components = 0;
+    stack.push_back(Node::Vector);
+  }
+
+  bool number(float val) {
+    if (skipDepth > 0) {
+      return true;
+    }
+    if (stack.empty()) {
+      return error("a scene is an object");
+    }
+    if (stack.back() == Node::Vector) {
+      if (components == 3) {
+        return error("expected three numbers");
+      }
+      (*vector)[components++] = val;
+    } else if (next == Value::Scalar) {
+      *scalar = val;
+    } else {
+      return scalarValue();
+    }
+    return true;
+  }
+
+  // A value that isn't used: fine for an unknown key, but not where a number or a type goes
+  bool scalarValue() {
+    if (skipDepth > 0) {
+      return true;
+    }
+    if (stack.empty() || inArray() || next == Value::Scalar || next == Value::Text) {
+      return error("unexpected value");
+    }
+    return true;
+  }
+
+  // the elements of these are read by position rather than by key
+  bool inArray() const {
+    Node node = stack.back();
+    return node == Node::Objects || node == Node::Lights || node == Node::Triangles
+        || node == Node::Triangle || node == Node::Vector;
+  }
+
+  // ignore a container nobody reads, e.g. "_source": { ... }
+  bool skip() {
+    if (next != Value::Skip) {
+      return error("unexpected object or array");
+    }
+    skipDepth = 1;
+    return true;
+  }
+
+  bool missing(const char *type, const char *field) {
+    return error(std::string(type) + " without " + field);
+  }
+
+  bool addObject() {
+    // an instance without a material of its own takes its mesh's, once that is known
+    MaterialIndex mi = 0;
+    if ((object.hasMaterial || object.type != "instance") && !add_material(s, object.material, materialIndex, mi)) {
+      return error("too many distinct materials");
+    }
+    if (!object.name.empty()) {
+      if (object.type != "mesh") {
+        return error("\"" + object.name + "\" in meshes is a " + object.type + ", not a mesh");
+      }
+      if (!sharedMeshes.insert({ object.name, (uint32_t)s.meshes.size() }).second) {
+        return error("two meshes are called \"" + object.name + "\"");
+      }
+      Mesh *mesh;
+      if (!addMesh(mi, mesh)) {
+        return false;
+      }
+      s.meshes.push_back(mesh);
+    } else if (object.type == "instance") {
+      // "meshes" may come later in the file, so the mesh is looked up by finish()
+      if (object.meshName.empty()) return missing("instance", "mesh");
+      Instance *instance = s.arena.make<Instance>(mi, UINT32_MAX,
+        Transform::placement(object.transform.scale, object.transform.rotate, object.transform.translate));
+      instances.push_back({ instance, object.meshName, object.hasMaterial });
+      s.objects.push_back(instance);
+    } else if (object.type == "sphere") {
+      if (!object.hasPosition) return missing("sphere", "position");
+      if (!object.hasRadius) return missing("sphere", "radius");
+      s.objects.push_back(s.arena.make<Sphere>(mi, object.radius, object.position));
+    } else if (object.type == "plane") {
+      if (!object.hasPosition) return missing("plane", "position");
+      if (!object.hasNormal) return missing("plane", "normal");
+      s.objects.push_back(s.arena.make<Plane>(mi, object.position, object.normal));
+    } else if (object.type == "mesh") {
+      Mesh *mesh;
+      if (!addMesh(mi, mesh)) {
+        return false;
+      }
+      s.objects.push_back(mesh);
+    } else {
+      return error("unrecognized object type \"" + object.type + "\"");
+    }
+    return true;
+  }
+
+  bool addMesh(MaterialIndex mi, Mesh *&mesh) {
+    if (object.hasTriangles == !object.file.empty()) {
+      return error("a mesh needs either triangles or a file");
+    }
+    if (!object.file.empty() && !loadMeshFile(mesh_path(dir, object.file), object.transform, object.mesh.vertices, object.mesh.indices)) {
+      return false;
+    }
+    mesh = s.arena.make<Mesh>(mi, std::move(object.mesh.vertices), std::move(object.mesh.indices));
+    return true;
+  }
+
+  bool addLight() {
+    if (!light.hasColor) return missing("light", "color");
+    if (light.type == "ambient") {
+      // There should only be one ambient light
+      for (Light *l : s.lights) {
+        if (l->type == LightType::Ambient) {
+          return error("there should only be one ambient light!");
+        }
+      }
+      s.lights.push_back(s.arena.make<AmbientLight>(light.color));
+    } else if (light.type == "directional") {
+      if (!light.hasDirection) return missing("directional light", "direction");
+      s.lights.push_back(s.arena.make<DirectionalLight>(light.color, light.direction));
+    } else if (light.type == "point") {
+      if (!light.hasPosition) return missing("point light", "position");
+      s.lights.push_back(s.arena.make<PointLight>(light.color, light.position));
+    } else if (light.type == "spot") {
+      if (!light.hasPosition) return missing("spot light", "position");
+      if (!light.hasDirection) return missing("spot light", "direction");
+      if (!light.hasCutoff) return missing("spot light", "cutoff");
+      s.lights.push_back(s.arena.make<SpotLight>(light.color, light.position, light.direction, light.cutoff));
+    } else {
+      return error("unrecognized light type \"" + light.type + "\"");
+    }
+    return true;
+  }
+
+  bool error(const std::string &message) {
+    std::cout << "*** " << message << "\n";
+    return false;
+  }
+
+  Scene &s;
+  const std::string &dir;
+  std::unordered_map<std::string, MaterialIndex> materialIndex;
+  std::vector<Node> stack;
+  int skipDepth;        // > 0 while inside a skipped container
+  Value next;
+  glm::vec3 *vector;    // where the Vector being read goes
+  int components;       // numbers read into it so far
+  float *scalar;        // where a Value::Scalar goes
+  std::string *text;    // and a Value::Text
+  std::string sharedName;   // the key of the mesh being read in "meshes"
+  std::unordered_map<std::string, uint32_t> sharedMeshes;   // into s.meshes, by name
+  std::vector<PendingInstance> instances;
+  int vertex;           // vertices read into the current triangle
+  PendingObject object;
+  PendingLight light;
+};
+
+int json_stream_to_scene(std::istream &in, Scene &s, const std::string &dir) {
+  SceneSaxReader reader(s, dir);
+  return json::sax_parse(in, &reader) && reader.finish() ? 0 : -1;
+}
+
+void free_scene(Scene &s) {
+  s.objects.clear();
+  s.meshes.clear();
+  s.lights.clear();
+  s.materials.clear();
+  s.arena.clear();
+}
+
+/****************************************************************************/
+
 void printf_rgb(RGB &rgb) {
   printf("RGB( %f, %f, %f )", rgb.r, rgb.g, rgb.b);
 }
@@ -152,6 +719,56 @@ void printf_material(Material &m) {
   printf(", %f )", m.refraction);
 }
 
+void printf_transform(Transform &t) {
+  printf("Transform( ");
+  printf_vector(t.rows[0]);
+  printf(", ");
+  printf_vector(t.rows[1]);
+  printf(", ");
+  printf_vector(t.rows[2]);
+  printf(", ");
+  printf_vector(t.translation);
+  printf(" )");
+}
+
+void printf_mesh(Mesh &m) {
+  printf("new Mesh( ");
+  printf("%u,\n", m.material);
+  printf("      {\n");
+  for (size_t j = 0; j < m.vertices.size(); j++) {
+    printf("         ");
+    printf_vertex(m.vertices[j]);
+    printf(j + 1 < m.vertices.size() ? ",\n" : "\n");
+  }
+  printf("      },\n");
+  printf("      {\n");
+  for (size_t j = 0; j < m.indices.size(); j += 3) {
+    printf("         %u, %u, %u", m.indices[j], m.indices[j + 1], m.indices[j + 2]);
+    printf(j + 3 < m.indices.size() ? ",\n" : "\n");
+  }
+  printf("      } )");
+}
+
+// Instances are bounded against their shared mesh when a scene is loaded; generated code does
+// the same when the program starts, before any BVH is built over the scene
+void printf_instance_bounds(Scene &s) {
+  bool instances = false;
+  for (Object *o : s.objects) {
+    instances = instances || o->type == ObjectType::Instance;
+  }
+  if (!instances) {
+    return;
+  }
+  printf("static const bool instancesBound = [] {\n");
+  printf("  for (Object *o : scene.objects) {\n");
+  printf("    if (o->type == ObjectType::Instance) {\n");
+  printf("      ((Instance *)o)->bound(*scene.meshes[((Instance *)o)->mesh]);\n");
+  printf("    }\n");
+  printf("  }\n");
+  printf("  return true;\n");
+  printf("}();\n");
+}
+
 void scene_to_cpp(Scene &s) {
   printf("Scene scene = {\n");
   printf("  // camera\n");
@@ -164,45 +781,33 @@ void scene_to_cpp(Scene &s) {
   for (int i = 0; i < s.objects.size(); i++) {
     Object *o = s.objects[i];
     
-    if (o->type == "sphere") {
+    if (o->type == ObjectType::Sphere) {
       Sphere *s = (Sphere *)(o);
       printf("    new Sphere( ");
-      printf_material(s->material);
-      printf(", %f, ", s->radius);
+      printf("%u, %f, ", s->material, s->radius);
       printf_vertex(s->position);
       printf(" )");
 
-    } else if (o->type == "plane") {
+    } else if (o->type == ObjectType::Plane) {
       Plane *p = (Plane *)(o);
       printf("    new Plane( ");
-      printf_material(p->material);
-      printf(", ");
+      printf("%u, ", p->material);
       printf_vertex(p->position);
       printf(", ");
       printf_vector(p->normal);
       printf(" )");
       
-    } else if (o->type == "mesh") {
+    } else if (o->type == ObjectType::Mesh) {
       Mesh *m = (Mesh *)(o);
-      printf("    new Mesh( ");
-      printf_material(m->material);
-      printf(",\n");
-      printf("      {\n");
-      for (int j = 0; j < m->triangles.size(); j++) {
-        printf("         { ");
-        printf_vertex(m->triangles[j].vertices[0]);
-        printf(", ");
-        printf_vertex(m->triangles[j].vertices[1]);
-        printf(", ");
-        printf_vertex(m->triangles[j].vertices[2]);
-        printf(" }");
-        if (j < m->triangles.size() - 1) {
-          printf(",\n");
-        } else {
-          printf("\n");
-        }
-      }
-      printf("      } )");
+      printf("    ");
+      printf_mesh(*m);
+
+    } else if (o->type == ObjectType::Instance) {
+      Instance *n = (Instance *)(o);
+      printf("    new Instance( ");
+      printf("%u, %u, ", n->material, n->mesh);
+      printf_transform(n->toWorld);
+      printf(" )");
     }
     
     if (i < s.objects.size() - 1) {
@@ -219,26 +824,26 @@ void scene_to_cpp(Scene &s) {
   for (int i = 0; i < s.lights.size(); i++) {
     Light *l = s.lights[i];
     
-    if (l->type == "ambient") {
+    if (l->type == LightType::Ambient) {
       AmbientLight *a = (AmbientLight *)(l);
       printf("    new AmbientLight( ");
       printf_rgb(a->color);
       printf(" )");
-    } else if (l->type == "directional") {
+    } else if (l->type == LightType::Directional) {
       DirectionalLight *d = (DirectionalLight *)(l);
       printf("    new DirectionalLight( ");
       printf_rgb(d->color);
       printf(", ");
       printf_vector(d->direction);
       printf(" )");
-    } else if (l->type == "point") {
+    } else if (l->type == LightType::Point) {
       PointLight *p = (PointLight *)(l);
       printf("    new PointLight( ");
       printf_rgb(p->color);
       printf(", ");
       printf_vertex(p->position);
       printf(" )");
-    } else if (l->type == "spot") {
+    } else if (l->type == LightType::Spot) {
       SpotLight *s = (SpotLight *)(l);
       printf("    new SpotLight( ");
       printf_rgb(s->color);
@@ -256,6 +861,35 @@ void scene_to_cpp(Scene &s) {
     }
   }
 
+  printf("  },\n");
+  printf("  // materials\n");
+  printf("  {\n");
+
+  for (size_t i = 0; i < s.materials.size(); i++) {
+    printf("    ");
+    printf_material(s.materials[i]);
+    if (i + 1 < s.materials.size()) {
+      printf(",\n");
+    } else {
+      printf("\n");
+    }
+  }
+
+  printf("  },\n");
+  printf("  // meshes\n");
+  printf("  {\n");
+
+  for (size_t i = 0; i < s.meshes.size(); i++) {
+    printf("    ");
+    printf_mesh(*s.meshes[i]);
+    if (i + 1 < s.meshes.size()) {
+      printf(",\n");
+    } else {
+      printf("\n");
+    }
+  }
+
   printf("  }\n");
   printf("};\n");
+  printf_instance_bounds(s);
 }
@@ -3,10 +3,19 @@
 
 using json = nlohmann::json;
 
-int json_to_scene(json &jscene, Scene &s);
+// Objects and lights are allocated in s.arena; free_scene() releases them all. Mesh files
+// named in the scene are read from dir (e.g. "scenes/").
+int json_to_scene(json &jscene, Scene &s, const std::string &dir = "");
+// The same, but parsing the JSON as it streams in rather than from a json DOM; use this one for
+// big scenes. Returns -1, after printing what was wrong, if the file isn't a valid scene.
+int json_stream_to_scene(std::istream &in, Scene &s, const std::string &dir = "");
+void free_scene(Scene &s);
 void printf_rgb(RGB &rgb);
 void printf_vertex(Vertex &v);
 void printf_vector(Vector &v);
 void printf_material(Material &m);
+void printf_transform(Transform &t);
+void printf_mesh(Mesh &m);
+void printf_instance_bounds(Scene &s);
 void scene_to_cpp(Scene &s);
 
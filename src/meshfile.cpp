@@ -0,0 +1,400 @@
+#include "meshfile.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+
+// Check every face's indices once the whole file is read (OBJ faces may come before their vertices)
+static bool validIndices(const std::string& fn, const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices) {
+    for (uint32_t index : indices) {
+        if (index >= vertices.size()) {
+            std::cout << "*** " << fn << " has a face with vertex " << index << " of " << vertices.size() << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// split a face into a fan of triangles around its first corner
+static void addFace(const std::vector<uint32_t>& face, std::vector<uint32_t>& indices) {
+    for (size_t k = 1; k + 1 < face.size(); k++) {
+        indices.push_back(face[0]);
+        indices.push_back(face[k]);
+        indices.push_back(face[k + 1]);
+    }
+}
+
+/****************************************************************************/
+
+// Reads "v x y z" and "f a b c ..." lines; a corner may be "a/t/n", and only a is used.
+// Negative indices count back from the last vertex read, as the format allows.
+static bool readObj(const std::string& fn, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+    std::ifstream in(fn.c_str());
+    if (!in.is_open()) {
+        std::cout << "*** unable to open mesh file " << fn << std::endl;
+        return false;
+    }
+    std::string line;
+    std::vector<uint32_t> face;
+    for (size_t lineNumber = 1; std::getline(in, line); lineNumber++) {
+        const char* p = line.c_str();
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if ((p[0] == 'v' || p[0] == 'f') && (p[1] == ' ' || p[1] == '\t')) {
+            const bool isVertex = p[0] == 'v';
+            p += 2;
+            char* end;
+            if (isVertex) {
+                float v[3];
+                for (int i = 0; i < 3; i++) {
+                    v[i] = strtof(p, &end);
+                    if (end == p) {
+                        std::cout << "*** " << fn << ":" << lineNumber << ": a vertex needs three coordinates" << std::endl;
+                        return false;
+                    }
+                    p = end;
+                }
+                vertices.push_back(Vertex(v[0], v[1], v[2]));
+                continue;
+            }
+            face.clear();
+            for (;;) {
+                while (isspace((unsigned char)*p)) {
+                    p++;
+                }
+                if (*p == '\0') {
+                    break;
+                }
+                long index = strtol(p, &end, 10);
+                if (end == p || index == 0) {
+                    std::cout << "*** " << fn << ":" << lineNumber << ": bad face" << std::endl;
+                    return false;
+                }
+                face.push_back(index > 0 ? (uint32_t)(index - 1) : (uint32_t)(vertices.size() + index));
+                // skip the texture and normal indices
+                for (p = end; *p != '\0' && !isspace((unsigned char)*p); p++) {}
+            }
+            if (face.size() < 3) {
+                std::cout << "*** " << fn << ":" << lineNumber << ": a face needs three corners" << std::endl;
+                return false;
+            }
+            addFace(face, indices);
+        }
+    }
+    return validIndices(fn, vertices, indices);
+}
+
+/****************************************************************************/
+
+enum class PlyType : uint8_t { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;           // of the value, or of each item of a list
+    bool list;
+    PlyType countType;      // lists: of the item count before the items
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> properties;
+
+    int find(const char* propertyName) const {
+        for (size_t i = 0; i < properties.size(); i++) {
+            if (properties[i].name == propertyName) {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+};
+
+static bool plyType(const std::string& name, PlyType& type) {
+    static const struct { const char* name; PlyType type; } types[] = {
+        { "char", PlyType::Int8 }, { "int8", PlyType::Int8 }, { "uchar", PlyType::UInt8 }, { "uint8", PlyType::UInt8 },
+        { "short", PlyType::Int16 }, { "int16", PlyType::Int16 }, { "ushort", PlyType::UInt16 }, { "uint16", PlyType::UInt16 },
+        { "int", PlyType::Int32 }, { "int32", PlyType::Int32 }, { "uint", PlyType::UInt32 }, { "uint32", PlyType::UInt32 },
+        { "float", PlyType::Float32 }, { "float32", PlyType::Float32 }, { "double", PlyType::Float64 }, { "float64", PlyType::Float64 },
+    };
+    for (auto& t : types) {
+        if (name == t.name) {
+            type = t.type;
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t plySize(PlyType type) {
+    switch (type) {
+    case PlyType::Int8: case PlyType::UInt8: return 1;
+    case PlyType::Int16: case PlyType::UInt16: return 2;
+    case PlyType::Int32: case PlyType::UInt32: case PlyType::Float32: return 4;
+    case PlyType::Float64: return 8;
+    }
+    return 0;
+}
+
+// Reads values out of the body of a binary PLY file, swapping their bytes if its byte order isn't ours
+struct PlyReader {
+    const char* at;
+    const char* end;
+    bool swap;
+
+    size_t left() const { return (size_t)(end - at); }
+
+    template <typename T>
+    T get() {
+        char bytes[sizeof(T)];
+        memcpy(bytes, at, sizeof(T));
+        at += sizeof(T);
+        if (swap) {
+            std::reverse(bytes, bytes + sizeof(T));
+        }
+        T value;
+        memcpy(&value, bytes, sizeof(T));
+        return value;
+    }
+
+    // false at the end of the data
+    bool read(PlyType type, double& value) {
+        if (left() < plySize(type)) {
+            return false;
+        }
+        switch (type) {
+        case PlyType::Int8: value = get<int8_t>(); break;
+        case PlyType::UInt8: value = get<uint8_t>(); break;
+        case PlyType::Int16: value = get<int16_t>(); break;
+        case PlyType::UInt16: value = get<uint16_t>(); break;
+        case PlyType::Int32: value = get<int32_t>(); break;
+        case PlyType::UInt32: value = get<uint32_t>(); break;
+        case PlyType::Float32: value = get<float>(); break;
+        case PlyType::Float64: value = get<double>(); break;
+        }
+        return true;
+    }
+};
+
+// Reads the "vertex" element's x, y and z and the "face" element's vertex_indices (or
+// vertex_index) lists; every other element and property is skipped over.
+static bool readPly(const std::string& fn, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+    std::ifstream in(fn.c_str(), std::ios::binary);
+    if (!in.is_open()) {
+        std::cout << "*** unable to open mesh file " << fn << std::endl;
+        return false;
+    }
+
+    std::string line;
+    std::getline(in, line);
+    if (line != "ply" && line != "ply\r") {
+        std::cout << "*** " << fn << " is not a PLY file" << std::endl;
+        return false;
+    }
+    bool littleEndian = false;
+    bool binary = false;
+    std::vector<PlyElement> elements;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        std::istringstream words(line);
+        std::string word;
+        words >> word;
+        if (word == "end_header") {
+            break;
+        } else if (word == "format") {
+            std::string format;
+            words >> format;
+            binary = format == "binary_little_endian" || format == "binary_big_endian";
+            littleEndian = format == "binary_little_endian";
+        } else if (word == "element") {
+            PlyElement element;
+            words >> element.name >> element.count;
+            if (words.fail()) {
+                std::cout << "*** " << fn << ": can't read element \"" << line << "\"" << std::endl;
+                return false;
+            }
+            elements.push_back(element);
+        } else if (word == "property" && !elements.empty()) {
+            PlyProperty property;
+            std::string type;
+            words >> type;
+            property.list = type == "list";
+            bool known;
+            if (property.list) {
+                std::string countType;
+                words >> countType >> type;
+                known = plyType(countType, property.countType) && plyType(type, property.type);
+            } else {
+                known = plyType(type, property.type);
+            }
+            words >> property.name;
+            if (!known || words.fail()) {
+                std::cout << "*** " << fn << ": can't read property \"" << line << "\"" << std::endl;
+                return false;
+            }
+            elements.back().properties.push_back(property);
+        }
+    }
+    if (!binary) {
+        std::cout << "*** " << fn << " is not a binary PLY file" << std::endl;
+        return false;
+    }
+
+    std::vector<char> body((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    const uint16_t one = 1;
+    const bool littleEndianHost = *(const uint8_t*)&one == 1;
+    PlyReader reader = { body.data(), body.data() + body.size(), littleEndian != littleEndianHost };
+
+    std::vector<uint32_t> face;
+    for (const PlyElement& element : elements) {
+        const bool isVertex = element.name == "vertex";
+        const bool isFace = element.name == "face";
+        int x = element.find("x"), y = element.find("y"), z = element.find("z");
+        int corners = element.find("vertex_indices");
+        if (corners < 0) {
+            corners = element.find("vertex_index");
+        }
+        if (isVertex && (x < 0 || y < 0 || z < 0)) {
+            std::cout << "*** " << fn << ": vertices need x, y and z" << std::endl;
+            return false;
+        }
+        if (isFace && (corners < 0 || !element.properties[corners].list)) {
+            std::cout << "*** " << fn << ": faces need a vertex_indices list" << std::endl;
+            return false;
+        }
+        // every record takes at least its scalars and its lists' counts, so a count the rest of the
+        // file can't hold is caught before anything is reserved for it
+        size_t recordBytes = 0;
+        for (const PlyProperty& property : element.properties) {
+            recordBytes += plySize(property.list ? property.countType : property.type);
+        }
+        if (recordBytes == 0) {
+            continue;
+        }
+        if (element.count > reader.left() / recordBytes) {
+            std::cout << "*** " << fn << " is truncated" << std::endl;
+            return false;
+        }
+        if (isVertex) {
+            vertices.reserve(element.count);
+        }
+
+        for (size_t i = 0; i < element.count; i++) {
+            Vertex v(0, 0, 0);
+            for (int p = 0; p < (int)element.properties.size(); p++) {
+                const PlyProperty& property = element.properties[p];
+                double value;
+                if (!property.list) {
+                    if (!reader.read(property.type, value)) {
+                        std::cout << "*** " << fn << " is truncated" << std::endl;
+                        return false;
+                    }
+                    if (isVertex && (p == x || p == y || p == z)) {
+                        v[p == x ? 0 : p == y ? 1 : 2] = (float)value;
+                    }
+                    continue;
+                }
+                double count;
+                if (!reader.read(property.countType, count)) {
+                    std::cout << "*** " << fn << " is truncated" << std::endl;
+                    return false;
+                }
+                if (!(count >= 0) || count > (double)(reader.left() / plySize(property.type))) {
+                    std::cout << "*** " << fn << ": a list's count (" << count << ") is negative or longer than the rest of the file" << std::endl;
+                    return false;
+                }
+                face.clear();
+                for (size_t k = 0; k < (size_t)count; k++) {
+                    if (!reader.read(property.type, value)) {
+                        std::cout << "*** " << fn << " is truncated" << std::endl;
+                        return false;
+                    }
+                    face.push_back((uint32_t)value);
+                }
+                if (isFace && p == corners) {
+                    if (face.size() < 3) {
+                        std::cout << "*** " << fn << ": a face needs three corners" << std::endl;
+                        return false;
+                    }
+                    addFace(face, indices);
+                }
+            }
+            if (isVertex) {
+                vertices.push_back(v);
+            }
+        }
+    }
+    return validIndices(fn, vertices, indices);
+}
+
+/****************************************************************************/
+
+// Place the model as utils/obj2json.py does, so a scene can switch from its output to the
+// model file without moving anything. That includes its quirk of subtracting only half the
+// centroid before scaling.
+static void transformVertices(const MeshTransform& t, std::vector<Vertex>& vertices) {
+    if (vertices.empty()) {
+        return;
+    }
+    double sum[3] = { 0, 0, 0 };
+    for (const Vertex& v : vertices) {
+        for (int i = 0; i < 3; i++) {
+            sum[i] += v[i];
+        }
+    }
+    const double half = 2.0 * vertices.size();
+    const Vector offset = Vector((float)(sum[0] / half), (float)(sum[1] / half), (float)(sum[2] / half));
+    float size = 0;
+    for (const Vertex& v : vertices) {
+        const Vector centred = glm::abs(v - offset);
+        size = std::max(size, std::max(centred.x, std::max(centred.y, centred.z)));
+    }
+    const Transform place = Transform::placement(size > 0 ? t.scale / size : t.scale, t.rotate, t.translate);
+    for (Vertex& vertex : vertices) {
+        vertex = place.point(vertex - offset);
+    }
+}
+
+static bool hasSuffix(const std::string& fn, const char* suffix) {
+    const size_t n = strlen(suffix);
+    if (fn.size() < n) {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (tolower((unsigned char)fn[fn.size() - n + i]) != suffix[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool loadMeshFile(const std::string& fn, const MeshTransform& transform, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+    bool loaded;
+    if (hasSuffix(fn, ".obj")) {
+        loaded = readObj(fn, vertices, indices);
+    } else if (hasSuffix(fn, ".ply")) {
+        loaded = readPly(fn, vertices, indices);
+    } else {
+        std::cout << "*** " << fn << " is not an .obj or .ply file" << std::endl;
+        return false;
+    }
+    if (!loaded) {
+        return false;
+    }
+    if (indices.empty()) {
+        std::cout << "*** " << fn << " has no faces" << std::endl;
+        return false;
+    }
+    transformVertices(transform, vertices);
+    return true;
+}
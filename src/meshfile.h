@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "schema.h"
+
+// Where a mesh file's model goes in the scene. These are the parameters utils/obj2json.py
+// takes, applied the same way: the model is centred and scaled so its largest extent is scale,
+// then rotated about x, y and z (in radians) and translated.
+struct MeshTransform {
+    float scale;
+    Vector rotate;
+    Vector translate;
+
+    MeshTransform() : scale(1), rotate(0, 0, 0), translate(0, 0, 0) {}
+};
+
+// Read a Wavefront OBJ (.obj) or binary PLY (.ply) file into an indexed mesh, keeping its shared
+// vertices shared. Only positions and faces are read; faces with more than three corners are
+// split into a fan of triangles. Returns false, after printing why, if the file can't be used.
+bool loadMeshFile(const std::string& fn, const MeshTransform& transform, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
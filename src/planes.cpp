@@ -0,0 +1,31 @@
+#include "planes.h"
+
+#include <glm/glm.hpp>
+
+void PlaneBuffer::add(Plane* plane)
+{
+    const Vector n = glm::normalize(plane->normal);
+    px.push_back(plane->position.x);
+    py.push_back(plane->position.y);
+    pz.push_back(plane->position.z);
+    nx.push_back(n.x);
+    ny.push_back(n.y);
+    nz.push_back(n.z);
+    planes.push_back(plane);
+}
+
+void PlaneBuffer::pad()
+{
+    std::vector<float>* coordinates[] = { &px, &py, &pz, &nx, &ny, &nz };
+    for (auto coordinate : coordinates)
+    {
+        coordinate->resize(size() + PLANE_LANES - 1, 0.0f);
+        coordinate->shrink_to_fit();
+    }
+    planes.shrink_to_fit();
+}
+
+size_t PlaneBuffer::bytes() const
+{
+    return 6 * px.capacity() * sizeof(float) + planes.capacity() * sizeof(Object*);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "schema.h"
+
+// Planes tested together by one SIMD intersection
+const int PLANE_LANES = 4;
+
+// The scene's planes, which are unbounded and so can't go in the BVH. They're kept as a
+// structure of arrays with their normals already normalised, so every ray can test
+// PLANE_LANES of them at once against the nearest hit found so far.
+struct PlaneBuffer {
+    std::vector<float> px, py, pz;      // a point on the plane
+    std::vector<float> nx, ny, nz;      // unit normal
+    std::vector<Object*> planes;        // the Plane each entry came from
+
+    size_t size() const { return planes.size(); }
+    bool empty() const { return planes.empty(); }
+    void add(Plane* plane);
+    // zero PLANE_LANES - 1 more entries of each array, so a group starting at any plane can be
+    // loaded whole; call once every plane has been added
+    void pad();
+    size_t bytes() const;
+};
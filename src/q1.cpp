@@ -4,6 +4,7 @@
 
 #include "common.h"
 #include "raytracer.h"
+#include "camera.h"
 
 #include <iostream>
 #include <chrono>
@@ -35,54 +36,25 @@ std::chrono::high_resolution_clock::time_point start;
 std::chrono::high_resolution_clock::time_point end;
 
 //----------------------------------------------------------------------------
-float randomFloat(float min, float max) {
+float randomFloat(Rng &rng, float min, float max) {
 	// Returns a random real in [min,max).
-	return min + (max - min) * randomFloat();
+	return min + (max - min) * randomFloat(rng);
 }
 
-std::vector<Vector> ss(int x, int y) {
-	float aspect_ratio = (float)vp_width / vp_height;
-	float h = d * (float)tan((M_PI * fov) / 180.0 / 2.0);
-	float w = h * aspect_ratio;
-
-	float top = h;
-	float bottom = -h;
-	float left = -w;
-	float right = w;
-
-	float offset = 0.25f;
-	if (!DISABLE_TOON_SHADING) {
-		offset = 1.0f;
-	}
+static View currentView() {
+	View view(vp_width, vp_height);
+	view.lookFrom = lookFrom;
+	view.lookAt = lookAt;
+	view.d = d;
+	return view;
+}
 
-	std::vector<Vector> result;
-	//top left
-	result.push_back(Vector(left + (right - left) * (x + lookAt.x + 0.5f - offset) / vp_width, bottom + (top - bottom) * (y + lookAt.y + 0.5f + offset) / vp_height, -d + lookAt.z));
-	//top right
-	result.push_back(Vector(left + (right - left) * (x + lookAt.x + 0.5f + offset) / vp_width, bottom + (top - bottom) * (y + lookAt.y + 0.5f + offset) / vp_height, -d + lookAt.z));
-	//bottom left
-	result.push_back(Vector(left + (right - left) * (x + lookAt.x + 0.5f - offset) / vp_width, bottom + (top - bottom) * (y + lookAt.y + 0.5f - offset) / vp_height, -d + lookAt.z));
-	//bottom right
-	result.push_back(Vector(left + (right - left) * (x + lookAt.x + 0.5f + offset) / vp_width, bottom + (top - bottom) * (y + lookAt.y + 0.5f - offset) / vp_height, -d + lookAt.z));
-
-	return result;
+ViewPlaneSamples ss(int x, int y) {
+	return viewPlaneSamples(currentView(), x, y);
 }
 	
 point3 s(int x, int y) {
-
-	float aspect_ratio = (float)vp_width / vp_height;
-	float h = d * (float)tan((M_PI * fov) / 180.0 / 2.0);
-	float w = h * aspect_ratio;
-   
-	float top = h;
-	float bottom = -h;
-	float left = -w;
-	float right = w;
-
-	float u = left + (right - left) * (x + lookAt.x + 0.5f) / vp_width;
-	float v = bottom + (top - bottom) * (y + lookAt.y + 0.5f) / vp_height;
-
-	return point3(u, v, -d + lookAt.z);
+	return viewPlanePoint(currentView(), x, y);
 }
 
 //----------------------------------------------------------------------------
@@ -147,13 +119,14 @@ void display( void ) {
 		if (drawing_y == int(drawing_y)) {
 
 			for (int x = 0; x < vp_width; x++) {
+				Rng rng = Rng::forPixel(x, y);
 				if (DISABLE_ANTIALIASING) {
-					if (!trace(lookFrom, s(x, y), texture[x], false)) {
+					if (!trace(lookFrom, s(x, y), texture[x], rng, false)) {
 						texture[x] = background_colour;
 					}
 				}
 				else {
-					if (!ssTrace(lookFrom, ss(x, y), texture[x], false)) {
+					if (!ssTrace(lookFrom, ss(x, y), texture[x], rng, false)) {
 						texture[x] = background_colour;
 					}
 				}
@@ -266,8 +239,9 @@ void mouse( int button, int state, int x, int y ) {
 		case GLUT_LEFT_BUTTON:
 			colour3 c;
 			point3 uvw = s(x, y);
+			Rng rng = Rng::forPixel(x, y);
 			std::cout << std::endl;
-			if (trace(eye, uvw, c, true)) {
+			if (trace(eye, uvw, c, rng, true)) {
 				std::cout << "HIT @ ( " << uvw.x << "," << uvw.y << "," << uvw.z << " )\n";
 				std::cout << "      colour = ( " << c.r << "," << c.g << "," << c.b << " )\n";
 			} else {
@@ -5,6 +5,7 @@
 
 #include "raytracer.h"
 #include "bvh.h"
+#include "planes.h"
 
 #include <iostream>
 #include <fstream>
@@ -13,8 +14,13 @@
 #include <glm/gtx/string_cast.hpp>
 #include <algorithm>
 #include <cstdlib>
+#include <sys/stat.h>
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
 
 #include "json2schema.h"
+#include "scenecache.h"
 
 const double PI = 3.1415926535897932384626433832795;
 const char *PATH = "scenes/";
@@ -25,74 +31,257 @@ const int MAX_R_DEPTH = 8;
 double fov = 60;
 RGB background_colour(0, 0, 0);
 
-const bool DISABLE_AMBIENT = false;
-const bool DISABLE_DIFFUSE = false;
-const bool DISABLE_SPECULAR = false;
-const bool DISABLE_SHADOW = false;
-const bool DISABLE_REFLECTION = false;
-const bool DISABLE_TRANSMISSION = false;
-const bool DISABLE_REFRACTION = false;
-const bool DISABLE_SHADOW_TRANSPARENCY = false;
-const bool DISABLE_BVH_ACCELERATION = false;
-const bool DISABLE_SCHLICKREFRACTION = false;
-const bool DISABLE_OUTLINE_SHADING = true;
-const bool DISABLE_SKETCH_SHADING = true;
+// Feature policies: what each ShadingMode's kernel includes. The tracing and shading functions
+// below are templates on one of these, so every mode is compiled separately with the features
+// it leaves out folded away, rather than tested on every ray.
+enum class ToonStyle { None, Shaded, Outline, Sketch };
+
+struct FinalFeatures {
+  static constexpr bool ambient = true;
+  static constexpr bool diffuse = true;
+  static constexpr bool specular = true;
+  static constexpr bool shadows = true;
+  static constexpr bool shadowTransparency = true;   // transmissive occluders let some light through
+  static constexpr bool reflection = true;
+  static constexpr bool transmission = true;
+  static constexpr bool refraction = true;
+  static constexpr bool schlick = true;              // Schlick's approximation chooses between reflecting and refracting
+  static constexpr bool bvh = true;                  // without it every ray tests every object
+  static constexpr ToonStyle toon = ToonStyle::None;
+};
+
+// direct light only, and shadows stop at the first occluder
+struct PreviewFeatures : FinalFeatures {
+  static constexpr bool shadowTransparency = false;
+  static constexpr bool reflection = false;
+  static constexpr bool transmission = false;
+};
+
+struct BruteForceFeatures : FinalFeatures {
+  static constexpr bool bvh = false;
+};
+
+struct ToonFeatures : FinalFeatures {
+  static constexpr ToonStyle toon = ToonStyle::Shaded;
+};
+
+struct OutlineFeatures : FinalFeatures {
+  static constexpr ToonStyle toon = ToonStyle::Outline;
+};
+
+struct SketchFeatures : FinalFeatures {
+  static constexpr ToonStyle toon = ToonStyle::Sketch;
+};
 
 // this could happen if: e.g. we have inconsistent winding
 const bool ALLOW_HIT_MESH_BACK = true;
 
-json jscene;
+// Scene state: written only by choose_scene(), and only read while tracing, so
+// trace()/ssTrace() can be called from several threads once the scene is loaded.
 Scene scene;
 Scene sortedScene;
-BVHNode* bvhNode;
-std::vector<Object*> planes;
+LinearBVH bvh;
+WideBVH wideBvh;    // used instead of bvh when the scene was loaded with BVHLayout::Wide
+PlaneBuffer planes;        // the scene's planes, tested before the BVH on every ray
+BVHBuildOptions sceneBvhOptions;   // what bvh or wideBvh was built with
+// The bottom level for instances: one BVH per mesh in scene.meshes, in the same layout as bvh or
+// wideBvh (the other layout's trees are empty)
+std::vector<LinearBVH> meshBvhs;
+std::vector<WideBVH> meshWideBvhs;
+
+// Debug output for a picked pixel. Each level of recursion adds a step to the indentation
+// printed before its messages; the steps are chained through the callers' stack frames and
+// only walked when something is printed, so tracing an unpicked ray never builds a string.
+struct PickTrace {
+    bool pick;
+    const PickTrace *parent;
+    const char *step;
+
+    explicit operator bool() const { return pick; }
+    PickTrace then(const char *next) const { return { pick, this, next }; }
+};
+
+// prints the indentation
+static std::ostream &operator<<(std::ostream &out, const PickTrace &trace) {
+    if (trace.parent != NULL)
+        out << *trace.parent;
+    return out << trace.step;
+}
 
-RGB light(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm, int r_depth, bool pick, std::string prefix);
+template <class Features>
+static RGB light(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm, int r_depth, Rng &rng, const PickTrace &pick);
+struct HitQuery;
+static void hitInstance(Instance *instance, HitQuery &q);
+template <class Features>
+static bool occludeInstance(const Instance *instance, const Vertex &e, const Vector &d, float near, float far, RGB &opacity, RayStats &stats);
 
 /****************************************************************************/
 
-float randomFloat() {
+float randomFloat(Rng &rng) {
     // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0f);
+    return rng.nextFloat();
+}
+
+// Use a scene cache only if it is at least as new as the JSON it was made from (or there is no JSON)
+static bool cache_is_fresh(const std::string &cname, const std::string &fname) {
+  struct stat cache, source;
+  if (stat(cname.c_str(), &cache) != 0) {
+    return false;
+  }
+  return stat(fname.c_str(), &source) != 0 || cache.st_mtime >= source.st_mtime;
+}
+
+// Build a BVH over objects in the layout sceneBvhOptions asks for, leaving the other one empty
+static void buildSceneBVH(const std::vector<Object*> &objects, LinearBVH &linear, WideBVH &wide) {
+  linear = buildLinearBVH(objects, sceneBvhOptions);
+  wide = WideBVH();
+  if (sceneBvhOptions.layout == BVHLayout::Wide)
+  {
+      // only one layout is kept, so traversal doesn't have to choose per ray
+      wide = collapseBVH(linear);
+      linear = LinearBVH();
+  }
+}
+
+// the planes are copied into planes, so this needs doing again whenever they move
+static void fillPlanes() {
+  planes = PlaneBuffer();
+  for (auto object : scene.objects)
+  {
+      if (object->type == ObjectType::Plane)
+          planes.add((Plane*)object);
+  }
+  planes.pad();
 }
 
-void choose_scene(char const *fn) {
+void choose_scene(char const *fn, const BVHBuildOptions &bvhOptions, bool useCache) {
 	if (fn == NULL) {
 		std::cout << "Using default input file " << PATH << "c.json\n";
 		fn = "b";
 	}
 
 	std::cout << "Loading scene " << fn << std::endl;
-	
+
+  // a previous scene and everything built from it goes first, so reloading doesn't leak
+  free_scene(scene);
+  planes = PlaneBuffer();
+  bvh = LinearBVH();
+  wideBvh = WideBVH();
+  meshBvhs.clear();
+  meshWideBvhs.clear();
+  sceneBvhOptions = bvhOptions;
+
 	std::string fname = PATH + std::string(fn) + ".json";
-	std::fstream in(fname);
-	if (!in.is_open()) {
-		std::cout << "Unable to open scene file " << fname << std::endl;
-		exit(EXIT_FAILURE);
-	}
-	
-	in >> jscene;
-  
-  if (json_to_scene(jscene, scene) < 0) {
-		std::cout << "Error in scene file " << fname << std::endl;
-		exit(EXIT_FAILURE);
+  std::string cname = PATH + std::string(fn) + SCENE_CACHE_SUFFIX;
+  if (useCache && cache_is_fresh(cname, fname) && readSceneCache(cname, bvhOptions, scene, bvh, wideBvh)) {
+    std::cout << "Loaded " << cname << std::endl;
+  } else {
+    std::fstream in(fname);
+    if (!in.is_open()) {
+      std::cout << "Unable to open scene file " << fname << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    if (json_stream_to_scene(in, scene, PATH) < 0) {
+      std::cout << "Error in scene file " << fname << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    buildSceneBVH(scene.objects, bvh, wideBvh);
   }
-  
+
+  // each mesh that instances share gets a BVH of its own, which the top level leads into
+  meshBvhs.resize(scene.meshes.size());
+  meshWideBvhs.resize(scene.meshes.size());
+  for (size_t i = 0; i < scene.meshes.size(); i++) {
+    buildSceneBVH(std::vector<Object*>(1, scene.meshes[i]), meshBvhs[i], meshWideBvhs[i]);
+  }
+
   fov = scene.camera.field;
   background_colour = scene.camera.background;
 
-  bvhNode = buildBVH(scene.objects);
-  for (auto object : scene.objects)
-  {
-      if (object->type == "plane")
-          planes.push_back(object);
+  fillPlanes();
+}
+
+Scene &loaded_scene() {
+  return scene;
+}
+
+// Refit one BVH, or rebuild it if refitting has left it too slow
+static bool refitSceneBVH(const std::vector<Object*> &objects, LinearBVH &linear, WideBVH &wide, float rebuildRatio) {
+  const float growth = sceneBvhOptions.layout == BVHLayout::Wide ? refitBVH(wide) : refitBVH(linear);
+  if (growth <= rebuildRatio)
+    return false;
+  buildSceneBVH(objects, linear, wide);
+  return true;
+}
+
+// the box around everything in a tree: its root's, or the union of a wide root's children
+static void treeBounds(const LinearBVH &linear, const WideBVH &wide, Vertex &lo, Vertex &hi) {
+  if (!linear.empty()) {
+    lo = linear.nodes[0].aabbMinBound;
+    hi = linear.nodes[0].aabbMaxBound;
+    return;
+  }
+  lo = Vertex(1e30f, 1e30f, 1e30f);
+  hi = Vertex(-1e30f, -1e30f, -1e30f);
+  if (wide.empty())
+    return;
+  const WideBVHNode &root = wide.nodes[0];
+  for (int i = 0; i < root.childCount; i++) {
+    lo = glm::min(lo, Vertex(root.minX[i], root.minY[i], root.minZ[i]));
+    hi = glm::max(hi, Vertex(root.maxX[i], root.maxY[i], root.maxZ[i]));
   }
 }
 
-float ray_sphere(Sphere *obj, const Vertex &e, const Vector &d, float near, float far, Vertex &hp, Vector &hp_norm, bool pick, std::string prefix) {
-  float result = -1;
+bool refit_scene(float rebuildRatio, bool meshesMoved) {
+  fillPlanes();
+  bool rebuilt = false;
+  // the shared meshes first, since the instances' bounds (and so the top level) depend on them
+  for (size_t i = 0; meshesMoved && i < scene.meshes.size(); i++) {
+    if (refitSceneBVH(std::vector<Object*>(1, scene.meshes[i]), meshBvhs[i], meshWideBvhs[i], rebuildRatio))
+      rebuilt = true;
+  }
+  for (auto object : scene.objects) {
+    if (object->type != ObjectType::Instance)
+      continue;
+    Instance *instance = (Instance*)object;
+    Vertex lo, hi;
+    treeBounds(meshBvhs[instance->mesh], meshWideBvhs[instance->mesh], lo, hi);
+    if (lo.x <= hi.x)
+      instance->bound(lo, hi);
+  }
+  if (refitSceneBVH(scene.objects, bvh, wideBvh, rebuildRatio))
+    rebuilt = true;
+  return rebuilt;
+}
+
+bool save_scene_cache(char const *fn) {
+  std::string cname = PATH + std::string(fn) + SCENE_CACHE_SUFFIX;
+  return writeSceneCache(cname, scene, sceneBvhOptions, bvh, wideBvh);
+}
+
+const LinearBVH &scene_bvh() {
+  return bvh;
+}
+
+const WideBVH &scene_wide_bvh() {
+  return wideBvh;
+}
+
+const std::vector<LinearBVH> &scene_mesh_bvhs() {
+  return meshBvhs;
+}
+
+const std::vector<WideBVH> &scene_mesh_wide_bvhs() {
+  return meshWideBvhs;
+}
 
-  Vertex &c = obj->position;
+// The *_t() tests only find the distance to an object: they return t if the ray hits it
+// within [near, far] (far < near means unbounded) and -1 otherwise. ray_triangle() and ray_mesh()
+// also fill in the hit point and surface normal.
+float sphere_t(const Sphere *obj, const Vertex &e, const Vector &d, float near, float far) {
+  const Vertex &c = obj->position;
   float radius = obj->radius;
   Vector eminusc = e - c;
   float ddotd = glm::dot(d, d);
@@ -101,240 +290,851 @@ float ray_sphere(Sphere *obj, const Vertex &e, const Vector &d, float near, floa
   if (disc >= 0) {
     double root = sqrt(disc);
     float t = float((glm::dot(-d,eminusc) + root) / ddotd);
-    // if (pick) std::cout << prefix << "checking sphere " << glm::to_string(c) << " with t=" << t << std::endl;
     if (disc > 0) {
       float t2 = float((glm::dot(-d,eminusc) - root) / ddotd);
-      // if (pick) std::cout << prefix << "checking sphere " << glm::to_string(c) << " with t2=" << t2 << std::endl;
       // choose the closest t intersection that's still >= near
       if ((t2 < t && t2 >= near) || (t2 > t && t < near)) {
         t = t2;
       }
     }
     if (t >= near && (far < near || t <= far)) {
-      if (pick) std::cout << prefix << "hit sphere " << glm::to_string(c) << " at t=" << t << std::endl;
-      hp = e + t * d;
-      hp_norm = glm::normalize(hp - c);
-      result = t;
+      return t;
     }
   }
   
-  return result;
+  return -1;
 }
 
-float ray_plane(Plane *obj, const Vertex &e, const Vector &d, float near, float far, Vertex &hp, Vector &hp_norm, bool pick, std::string prefix) {
-  float result = -1;
-
-  Vertex &a = obj->position;
-  Vector n = glm::normalize(obj->normal);
+float plane_t(const Plane *obj, const Vertex &e, const Vector &d, float near, float far, Vector &n) {
+  const Vertex &a = obj->position;
+  n = glm::normalize(obj->normal);
   float ndotd = glm::dot(n, d);
   if (ndotd != 0) {
     float t = glm::dot(n, a - e) / ndotd;
     if (t >= near && (far < near || t <= far)) {
-      if (pick) std::cout << prefix << "hit plane " << glm::to_string(a) << " at t=" << t << std::endl;
-      hp = e + t * d;
-      hp_norm = n;
-      result = t;
+      return t;
     }
   }
   
-  return result;
+  return -1;
 }
 
-float ray_triangle(Triangle &tri, const point3 &e, const point3 &d, float near, float far, Vertex &pt, Vector &n, bool pick, std::string prefix) {
-  Vertex &a = tri.vertices[0];
-  Vertex &b = tri.vertices[1];
-  Vertex &c = tri.vertices[2];
-  n = glm::normalize(glm::cross(c-b, a-b));
-
-  float ndotd = glm::dot(n, d);
-  // respect triangle winding
-  if (ndotd != 0) {
-    float t = glm::dot(n, a - e) / ndotd;
-    if (t >= near && (far < near || t <= far)) {
-      pt = e + t * d;
-      Vertex bary = point3(
-        glm::dot(glm::cross(b-a,pt-a),n),
-        glm::dot(glm::cross(c-b,pt-b),n),
-        glm::dot(glm::cross(a-c,pt-c),n)
-      );
-      if (bary.x > 0 && bary.y > 0 && bary.z > 0) {
-        if (pick) std::cout << prefix << "hit triangle " << glm::to_string(a) << " at t=" << t << std::endl;
-        return t;
-      }
-      if (ALLOW_HIT_MESH_BACK && bary.x < 0 && bary.y < 0 && bary.z < 0) {
-        if (pick) std::cout << prefix << "hit back of triangle " << glm::to_string(a) << " at t=" << t << std::endl;
-        return t;
-      }
-    }
+// The same test against PLANE_LANES planes of the buffer at once, starting at first; lanes
+// from count on are ignored. Each lane does exactly the arithmetic plane_t() does.
+// Returns a bit mask of the planes hit, with their distances in t.
+static int planes_t(const PlaneBuffer &pb, uint32_t first, int count, const point3 &e, const Vector &d, float near, float far, float t[PLANE_LANES]) {
+  int mask = 0;
+#if defined(__SSE__) || defined(_M_X64)
+  static_assert(PLANE_LANES == 4, "the SSE test covers four planes");
+  const __m128 nx = _mm_loadu_ps(&pb.nx[first]), ny = _mm_loadu_ps(&pb.ny[first]), nz = _mm_loadu_ps(&pb.nz[first]);
+
+  // t = (n . (a - e)) / (n . d), unless the ray runs parallel to the plane
+  const __m128 ndotd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_set1_ps(d.x)), _mm_mul_ps(ny, _mm_set1_ps(d.y))), _mm_mul_ps(nz, _mm_set1_ps(d.z)));
+  const __m128 sx = _mm_sub_ps(_mm_loadu_ps(&pb.px[first]), _mm_set1_ps(e.x));
+  const __m128 sy = _mm_sub_ps(_mm_loadu_ps(&pb.py[first]), _mm_set1_ps(e.y));
+  const __m128 sz = _mm_sub_ps(_mm_loadu_ps(&pb.pz[first]), _mm_set1_ps(e.z));
+  const __m128 tt = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, sx), _mm_mul_ps(ny, sy)), _mm_mul_ps(nz, sz)), ndotd);
+  __m128 hit = _mm_and_ps(_mm_cmpneq_ps(ndotd, _mm_setzero_ps()), _mm_cmpge_ps(tt, _mm_set1_ps(near)));
+  if (far >= near) {
+    hit = _mm_and_ps(hit, _mm_cmple_ps(tt, _mm_set1_ps(far)));
   }
+  _mm_storeu_ps(t, tt);
+  mask = _mm_movemask_ps(hit);
+#else
+  for (int i = 0; i < count; i++) {
+    const uint32_t j = first + i;
+    const Vector n(pb.nx[j], pb.ny[j], pb.nz[j]);
+    const float ndotd = glm::dot(n, d);
+    t[i] = ndotd != 0 ? glm::dot(n, Vertex(pb.px[j], pb.py[j], pb.pz[j]) - e) / ndotd : -1;
+    if (ndotd != 0 && t[i] >= near && (far < near || t[i] <= far))
+      mask |= 1 << i;
+  }
+#endif
+  return mask & ((1 << count) - 1);
+}
 
+// Moller-Trumbore test against the triangle with corner a and edges ab = b - a, ac = c - a.
+// Either side can be hit; points on an edge don't count.
+static inline float triangle_t(const Vertex &a, const Vector &ab, const Vector &ac, const point3 &e, const Vector &d, float near, float far) {
+  Vector p = glm::cross(d, ac);
+  float det = glm::dot(ab, p);
+  if (det == 0) {
+    return -1;
+  }
+  float invDet = 1.0f / det;
+  Vector s = e - a;
+  float u = glm::dot(s, p) * invDet;
+  if (!(u > 0 && u < 1)) {
+    return -1;
+  }
+  Vector q = glm::cross(s, ab);
+  float v = glm::dot(d, q) * invDet;
+  if (!(v > 0 && u + v < 1)) {
+    return -1;
+  }
+  float t = glm::dot(ac, q) * invDet;
+  if (t >= near && (far < near || t <= far)) {
+    return t;
+  }
   return -1;
 }
 
-float ray_mesh(Mesh *obj, const Vertex &e, const Vector &d, float near, float far, Vertex &hp, Vector &hp_norm, bool pick, std::string prefix) {
+float triangle_t(const Triangle &tri, const point3 &e, const point3 &d, float near, float far) {
+  const Vertex &a = tri.vertices[0];
+  return triangle_t(a, tri.vertices[1] - a, tri.vertices[2] - a, e, d, near, far);
+}
+
+// The same test against TRIANGLE_LANES triangles of the buffer at once, starting at first;
+// lanes from count on are ignored. Each lane does exactly the arithmetic triangle_t() does.
+// Returns a bit mask of the triangles hit, with their distances in t.
+int triangles_t(const TriangleBuffer &tb, uint32_t first, int count, const point3 &e, const Vector &d, float near, float far, float t[TRIANGLE_LANES]) {
+  int mask = 0;
+#if defined(__SSE__) || defined(_M_X64)
+  static_assert(TRIANGLE_LANES == 4, "the SSE test covers four triangles");
+  const __m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+  const __m128 e1x = _mm_loadu_ps(&tb.e1x[first]), e1y = _mm_loadu_ps(&tb.e1y[first]), e1z = _mm_loadu_ps(&tb.e1z[first]);
+  const __m128 e2x = _mm_loadu_ps(&tb.e2x[first]), e2y = _mm_loadu_ps(&tb.e2y[first]), e2z = _mm_loadu_ps(&tb.e2z[first]);
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+
+  // p = d x e2, det = e1 . p
+  const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+  const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+  const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+  const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+  __m128 hit = _mm_cmpneq_ps(det, zero);
+  const __m128 invDet = _mm_div_ps(one, det);
+
+  // s = e - v0, u = (s . p) / det
+  const __m128 sx = _mm_sub_ps(_mm_set1_ps(e.x), _mm_loadu_ps(&tb.v0x[first]));
+  const __m128 sy = _mm_sub_ps(_mm_set1_ps(e.y), _mm_loadu_ps(&tb.v0y[first]));
+  const __m128 sz = _mm_sub_ps(_mm_set1_ps(e.z), _mm_loadu_ps(&tb.v0z[first]));
+  const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+  hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(u, zero), _mm_cmplt_ps(u, one)));
+
+  // q = s x e1, v = (d . q) / det
+  const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+  const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+  const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+  const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+  hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(v, zero), _mm_cmplt_ps(_mm_add_ps(u, v), one)));
+
+  // t = (e2 . q) / det, within [near, far]
+  const __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(tt, _mm_set1_ps(near)));
+  if (far >= near) {
+    hit = _mm_and_ps(hit, _mm_cmple_ps(tt, _mm_set1_ps(far)));
+  }
+  _mm_storeu_ps(t, tt);
+  mask = _mm_movemask_ps(hit);
+#else
+  for (int i = 0; i < count; i++) {
+    const uint32_t j = first + i;
+    t[i] = triangle_t(Vertex(tb.v0x[j], tb.v0y[j], tb.v0z[j]), Vector(tb.e1x[j], tb.e1y[j], tb.e1z[j]), Vector(tb.e2x[j], tb.e2y[j], tb.e2z[j]), e, d, near, far);
+    if (t[i] >= near)
+      mask |= 1 << i;
+  }
+#endif
+  return mask & ((1 << count) - 1);
+}
+
+// the unit normal from the triangle's winding; TriangleBuffer::normal has it precomputed
+Vector triangle_normal(const Triangle &tri) {
+  const Vertex &a = tri.vertices[0];
+  const Vertex &b = tri.vertices[1];
+  const Vertex &c = tri.vertices[2];
+  return glm::normalize(glm::cross(c-b, a-b));
+}
+
+float ray_triangle(const Triangle &tri, const point3 &e, const point3 &d, float near, float far, Vertex &pt, Vector &n, const PickTrace &pick) {
+  float t = triangle_t(tri, e, d, near, far);
+  if (t >= near) {
+    if (pick) std::cout << pick << "hit triangle " << glm::to_string(tri.vertices[0]) << " at t=" << t << std::endl;
+    pt = e + t * d;
+    n = triangle_normal(tri);
+  }
+  return t;
+}
+
+float ray_mesh(const Mesh *obj, const Vertex &e, const Vector &d, float near, float far, Vertex &hp, Vector &hp_norm, const PickTrace &pick) {
   float nearest_t = -1;
   float t;
   Vertex tri_hp;
   Vector tri_norm;
 
   int hit_i = -1;
-  for (int i = 0; i < obj->triangles.size(); i++) {
-    auto &tri = obj->triangles[i];
-    t = ray_triangle(tri, e, d, near, far, tri_hp, tri_norm, pick, prefix);
+  for (size_t i = 0; i < obj->triangleCount(); i++) {
+    Triangle tri = obj->triangle(i);
+    t = ray_triangle(tri, e, d, near, far, tri_hp, tri_norm, pick);
 		if (t >= near && (nearest_t < 0 || t < nearest_t)) {
 			nearest_t = t;
       far = t;
       hp = tri_hp;
       hp_norm = tri_norm;
-      hit_i = i;
+      hit_i = (int)i;
     }
   }
-  if (pick && hit_i >= 0) std::cout << prefix << "mesh chose triangle #" << hit_i << std::endl;
+  if (pick && hit_i >= 0) std::cout << pick << "mesh chose triangle #" << hit_i << std::endl;
   
   return nearest_t;
 }
 
-bool ray_box(BVHNode* bvhNode, const point3& e, const point3& d, float near, float far, bool pick)
+// Slab test against a node's bounds, clipped to [near, far] (far < near means unbounded).
+// invD is 1/d per axis, computed once per ray. On a hit, tEntry is where the ray enters the
+// box (or near, if it starts inside).
+bool ray_box(const LinearBVHNode& node, const point3& e, const Vector& invD, float near, float far, float& tEntry)
 {
-    float tMin = float(-1e30f);
-    float tMax = float(1e30f);
+    float tMin = near;
+    float tMax = far < near ? float(1e30f) : far;
     for (int i = 0; i < 3; i++) {
-        auto invD = 1.0f / d[i];
-        auto t0 = (bvhNode->aabbMinBound[i] - e[i]) * invD;
-        auto t1 = (bvhNode->aabbMaxBound[i] - e[i]) * invD;
-        if (invD < 0.0f) {
+        auto t0 = (node.aabbMinBound[i] - e[i]) * invD[i];
+        auto t1 = (node.aabbMaxBound[i] - e[i]) * invD[i];
+        if (invD[i] < 0.0f) {
             std::swap(t0, t1);
         }
         tMin = t0 > tMin ? t0 : tMin;
         tMax = t1 < tMax ? t1 : tMax;
     }
-    return tMax >= std::max(0.0f, tMin);
+    tEntry = tMin;
+    return tMax >= tMin;
 }
 
-std::vector<Object*> getBVHList(BVHNode* bvhNode, const Vertex& e, const Vector& d, float near, float far, bool pick, std::string& prefix)
+// The same slab test against all of a wide node's children at once. Returns a bit mask of the
+// children that are hit, with their entry distances in tEntry.
+int ray_box_wide(const WideBVHNode& node, const point3& e, const Vector& invD, float near, float far, float tEntry[BVH_WIDE])
 {
-    if (bvhNode->obj)
+    // which face of each slab the ray enters through depends only on the ray's direction
+    const float* loX = invD.x < 0.0f ? node.maxX : node.minX;
+    const float* hiX = invD.x < 0.0f ? node.minX : node.maxX;
+    const float* loY = invD.y < 0.0f ? node.maxY : node.minY;
+    const float* hiY = invD.y < 0.0f ? node.minY : node.maxY;
+    const float* loZ = invD.z < 0.0f ? node.maxZ : node.minZ;
+    const float* hiZ = invD.z < 0.0f ? node.minZ : node.maxZ;
+    const float farOrInf = far < near ? float(1e30f) : far;
+    int mask = 0;
+#if defined(__SSE__) || defined(_M_X64)
+    static_assert(BVH_WIDE == 4, "the SSE test covers four children");
+    const __m128 ex = _mm_set1_ps(e.x), ey = _mm_set1_ps(e.y), ez = _mm_set1_ps(e.z);
+    const __m128 ix = _mm_set1_ps(invD.x), iy = _mm_set1_ps(invD.y), iz = _mm_set1_ps(invD.z);
+    // written as in ray_box(): a NaN slab distance (ray in the slab's plane) leaves the interval alone
+    __m128 tMin = _mm_set1_ps(near);
+    __m128 tMax = _mm_set1_ps(farOrInf);
+    tMin = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(loX), ex), ix), tMin);
+    tMax = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(hiX), ex), ix), tMax);
+    tMin = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(loY), ey), iy), tMin);
+    tMax = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(hiY), ey), iy), tMax);
+    tMin = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(loZ), ez), iz), tMin);
+    tMax = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(hiZ), ez), iz), tMax);
+    _mm_storeu_ps(tEntry, tMin);
+    mask = _mm_movemask_ps(_mm_cmpge_ps(tMax, tMin));
+#else
+    for (int i = 0; i < BVH_WIDE; i++) {
+        float tMin = near;
+        float tMax = farOrInf;
+        float t0 = (loX[i] - e.x) * invD.x, t1 = (hiX[i] - e.x) * invD.x;
+        tMin = t0 > tMin ? t0 : tMin;
+        tMax = t1 < tMax ? t1 : tMax;
+        t0 = (loY[i] - e.y) * invD.y, t1 = (hiY[i] - e.y) * invD.y;
+        tMin = t0 > tMin ? t0 : tMin;
+        tMax = t1 < tMax ? t1 : tMax;
+        t0 = (loZ[i] - e.z) * invD.z, t1 = (hiZ[i] - e.z) * invD.z;
+        tMin = t0 > tMin ? t0 : tMin;
+        tMax = t1 < tMax ? t1 : tMax;
+        tEntry[i] = tMin;
+        if (tMax >= tMin)
+            mask |= 1 << i;
+    }
+#endif
+    return mask & ((1 << node.childCount) - 1);
+}
+
+// State of one hit() query, shared by every object it tests
+struct HitQuery {
+    const Vertex &e;
+    const Vector &d;
+    float near;
+    float far;
+    float nearest_t;
+    Vertex &hit_at;
+    Vector &hit_normal;
+    Object *&hit_object;
+    const TriangleBuffer *hit_triangles;    // if the nearest hit is a BVH triangle, its buffer...
+    uint32_t hit_triangle;                  // ...and index there
+    const PickTrace &pick;
+    RayStats stats;
+};
+
+// Intersect one object and, if it's the closest so far, record it in the query. Only the
+// distance is found here; the hit point and normal are filled in by finishHit() for the
+// object that's nearest in the end (meshes tested as a whole find theirs as they go).
+static void hitObject(Object *object, HitQuery &q) {
+    float t = -1;
+    Vertex at;
+    Vector normal;
+
+    q.stats.primitiveTests++;
+    switch (object->type)
+    {
+    case ObjectType::Sphere:
+        t = sphere_t((Sphere*)(object), q.e, q.d, q.near, q.far);
+        if (q.pick && t >= q.near) std::cout << q.pick << "hit sphere " << glm::to_string(((Sphere*)(object))->position) << " at t=" << t << std::endl;
+        break;
+    case ObjectType::Plane:
+        t = plane_t((Plane*)(object), q.e, q.d, q.near, q.far, normal);
+        if (q.pick && t >= q.near) std::cout << q.pick << "hit plane " << glm::to_string(((Plane*)(object))->position) << " at t=" << t << std::endl;
+        break;
+    case ObjectType::Mesh:
+        t = ray_mesh((Mesh*)(object), q.e, q.d, q.near, q.far, at, normal, q.pick);
+        q.stats.triangleTests += ((Mesh*)(object))->triangleCount();
+        break;
+    case ObjectType::Instance:
+        // the nearest triangle is found, and recorded, in the mesh's own BVH
+        hitInstance((Instance*)(object), q);
+        return;
+    }
+
+    if (t > 0 && (q.nearest_t < 0 || t < q.nearest_t))
     {
-        if (ray_box(bvhNode, e, d, near, far, pick))
+        q.nearest_t = t;
+        q.far = t;
+        q.hit_object = object;
+        q.hit_triangles = NULL;
+        if (object->type == ObjectType::Mesh)
         {
-            return { bvhNode->obj };
+            q.hit_at = at;
+            q.hit_normal = normal;
         }
-        else {
-            return {};
+    }
+}
+
+// Intersect a BVH leaf's triangles, TRIANGLE_LANES at a time, recording the closest as hitObject() does
+static void hitTriangles(const TriangleBuffer &tb, uint32_t first, int count, HitQuery &q) {
+    for (int group = 0; group < count; group += TRIANGLE_LANES)
+    {
+        const int lanes = std::min(TRIANGLE_LANES, count - group);
+        float t[TRIANGLE_LANES];
+        int mask = triangles_t(tb, first + group, lanes, q.e, q.d, q.near, q.far, t);
+        q.stats.primitiveTests += lanes;
+        q.stats.triangleTests += lanes;
+        for (int i = 0; i < lanes; i++)
+        {
+            if (!(mask & (1 << i)))
+                continue;
+            const uint32_t index = first + group + i;
+            if (q.pick)
+                std::cout << q.pick << "hit triangle " << glm::to_string(Vertex(tb.v0x[index], tb.v0y[index], tb.v0z[index])) << " at t=" << t[i] << std::endl;
+            if (t[i] > 0 && (q.nearest_t < 0 || t[i] < q.nearest_t))
+            {
+                q.nearest_t = t[i];
+                q.far = t[i];
+                q.hit_object = (Object*)tb.owner(index);
+                q.hit_triangles = &tb;
+                q.hit_triangle = index;
+            }
+        }
+    }
+}
+
+// Intersect every plane, PLANE_LANES at a time, recording the closest as hitObject() does. Only
+// planes nearer than the closest hit so far count, so once one plane is hit the rest are
+// limited to the distance to it.
+static void hitPlanes(const PlaneBuffer &pb, HitQuery &q) {
+    for (size_t group = 0; group < pb.size(); group += PLANE_LANES)
+    {
+        const int lanes = (int)std::min<size_t>(PLANE_LANES, pb.size() - group);
+        float t[PLANE_LANES];
+        int mask = planes_t(pb, (uint32_t)group, lanes, q.e, q.d, q.near, q.far, t);
+        q.stats.primitiveTests += lanes;
+        for (int i = 0; i < lanes; i++)
+        {
+            if (!(mask & (1 << i)))
+                continue;
+            Object *plane = pb.planes[group + i];
+            if (q.pick)
+                std::cout << q.pick << "hit plane " << glm::to_string(((Plane*)(plane))->position) << " at t=" << t[i] << std::endl;
+            if (t[i] > 0 && (q.nearest_t < 0 || t[i] < q.nearest_t))
+            {
+                q.nearest_t = t[i];
+                q.far = t[i];
+                q.hit_object = plane;
+                q.hit_triangles = NULL;
+            }
         }
     }
+}
 
-    std::vector<Object*> bvhList;
-    if (ray_box(bvhNode->left, e, d, near, far, pick)) {
-        auto append = getBVHList(bvhNode->left, e, d, near, far, pick, prefix);
-        bvhList.insert(bvhList.end(), append.begin(), append.end());
+// Work out the hit point and surface normal for the nearest object found
+static void finishHit(HitQuery &q) {
+    if (q.nearest_t < 0)
+        return;
+
+    if (q.hit_triangles != NULL)
+    {
+        q.hit_at = q.e + q.nearest_t * q.d;
+        q.hit_normal = q.hit_triangles->normal[q.hit_triangle];
+        // an instance's triangle normals are in its mesh's space
+        if (q.hit_object->type == ObjectType::Instance)
+            q.hit_normal = glm::normalize(((Instance*)(q.hit_object))->toObject.transposed(q.hit_normal));
+        return;
     }
-    if (ray_box(bvhNode->right, e, d, near, far, pick)) {
-        auto append = getBVHList(bvhNode->right, e, d, near, far, pick, prefix);
-        bvhList.insert(bvhList.end(), append.begin(), append.end());
+
+    Object *object = q.hit_object;
+    switch (object->type)
+    {
+    case ObjectType::Sphere:
+        q.hit_at = q.e + q.nearest_t * q.d;
+        q.hit_normal = glm::normalize(q.hit_at - ((Sphere*)(object))->position);
+        break;
+    case ObjectType::Plane:
+        q.hit_at = q.e + q.nearest_t * q.d;
+        q.hit_normal = glm::normalize(((Plane*)(object))->normal);
+        break;
+    case ObjectType::Mesh:
+    case ObjectType::Instance:
+        break;
     }
+}
 
-    return bvhList;
+// Add an occluder's opacity to the running total; true once the light is fully blocked
+template <class Features>
+static bool addOpacity(const Object *object, RGB &opacity) {
+    if (!Features::shadowTransparency)
+    {
+        opacity = RGB(1, 1, 1);
+        return true;
+    }
+    opacity += RGB(1, 1, 1) - scene.materials[object->material].transmissive;
+    opacity = glm::clamp(opacity, 0.0f, 1.0f);
+    return opacity == RGB(1, 1, 1);
 }
 
-float hit(const Vertex &e, const Vector &d, float near, float far, Vertex &hit_at, Vector &hit_normal, Object *&hit_object, RGB *opacity_sum, bool pick, std::string prefix) {
+// Test one object as a shadow occluder and add its opacity to the running total.
+// Returns true once the light is fully blocked, so the query can stop.
+template <class Features>
+static bool occludeObject(const Object *object, const Vertex &e, const Vector &d, float near, float far, RGB &opacity, RayStats &stats) {
+    float t = -1;
+    Vector unused_n;
 
-    float t, nearest_t = -1;
-    Vertex at;
-    Vector normal;   
-    std::vector<Object*> candidates;
-    if (!DISABLE_BVH_ACCELERATION)
+    stats.primitiveTests++;
+    switch (object->type)
     {
-
-        for (auto plane : planes)
+    case ObjectType::Sphere:
+        t = sphere_t((const Sphere*)(object), e, d, near, far);
+        break;
+    case ObjectType::Plane:
+        t = plane_t((const Plane*)(object), e, d, near, far, unused_n);
+        break;
+    case ObjectType::Mesh:
+        // a mesh blocks the light once, however many of its triangles are in the way
+        for (size_t i = 0; i < ((const Mesh*)(object))->triangleCount(); i++)
         {
-            candidates.push_back(plane);
+            stats.triangleTests++;
+            t = triangle_t(((const Mesh*)(object))->triangle(i), e, d, near, far);
+            if (t >= near)
+                break;
         }
+        break;
+    case ObjectType::Instance:
+        return occludeInstance<Features>((const Instance*)(object), e, d, near, far, opacity, stats);
+    }
+
+    if (!(t >= near && (far < near || t <= far)))
+        return false;
+
+    return addOpacity<Features>(object, opacity);
+}
 
-        std::vector<Object*> append = getBVHList(bvhNode, e, d, near, far, pick, prefix);
-        candidates.insert(candidates.end(), append.begin(), append.end());
+// Test a BVH leaf's triangles as occluders, TRIANGLE_LANES at a time; each one in the way
+// counts as occludeObject() counts an object. The triangles of a shared mesh take their
+// material from the instance being traced, if there is one.
+template <class Features>
+static bool occludeTriangles(const TriangleBuffer &tb, const Object *instance, uint32_t first, int count, const Vertex &e, const Vector &d, float near, float far, RGB &opacity, RayStats &stats, const PickTrace &pick) {
+    for (int group = 0; group < count; group += TRIANGLE_LANES)
+    {
+        const int lanes = std::min(TRIANGLE_LANES, count - group);
+        float t[TRIANGLE_LANES];
+        int mask = triangles_t(tb, first + group, lanes, e, d, near, far, t);
+        stats.primitiveTests += lanes;
+        stats.triangleTests += lanes;
+        for (int i = 0; i < lanes; i++)
+        {
+            if ((mask & (1 << i)) && addOpacity<Features>(instance != NULL ? instance : tb.owner(first + group + i), opacity))
+            {
+                if (pick)
+                    std::cout << pick << "shadowed by triangle" << std::endl;
+                return true;
+            }
+        }
+    }
+    return false;
+}
 
-        if (pick)
+// Test every plane as an occluder, PLANE_LANES at a time, as occludeObject() tests one
+template <class Features>
+static bool occludePlanes(const PlaneBuffer &pb, const Vertex &e, const Vector &d, float near, float far, RGB &opacity, RayStats &stats, const PickTrace &pick) {
+    for (size_t group = 0; group < pb.size(); group += PLANE_LANES)
+    {
+        const int lanes = (int)std::min<size_t>(PLANE_LANES, pb.size() - group);
+        float t[PLANE_LANES];
+        int mask = planes_t(pb, (uint32_t)group, lanes, e, d, near, far, t);
+        stats.primitiveTests += lanes;
+        for (int i = 0; i < lanes; i++)
         {
-            for (auto& candidate : append)
+            if ((mask & (1 << i)) && addOpacity<Features>(pb.planes[group + i], opacity))
             {
-                std::cout << prefix + "BVH traversal result: " + candidate->type << std::endl;
+                if (pick)
+                    std::cout << pick << "shadowed by plane" << std::endl;
+                return true;
             }
         }
     }
-    else
+    return false;
+}
+
+struct BVHStackEntry {
+    uint32_t node;
+    float tEntry;
+};
+
+// a child of a wide node: another node, or a leaf's range of objects or triangles
+struct WideStackEntry {
+    uint32_t child;
+    uint16_t objectCount;
+    uint8_t triangles;
+    float tEntry;
+};
+
+thread_local RayStats threadRayStats;
+
+RayStats& rayStats() {
+    return threadRayStats;
+}
+
+// walk the binary BVH with a fixed stack, nearer child first, testing leaves as we reach them
+static void hitLinear(const LinearBVH &tree, HitQuery &q) {
+    const Vector invD(1.0f / q.d.x, 1.0f / q.d.y, 1.0f / q.d.z);
+    BVHStackEntry stack[BVH_MAX_DEPTH];
+    int top = 0;
+    float tEntry;
+    q.stats.boxTests++;
+    if (ray_box(tree.nodes[0], q.e, invD, q.near, q.far, tEntry))
     {
-        candidates = scene.objects;
+        stack[top++] = { 0, tEntry };
     }
+    while (top > 0)
+    {
+        const BVHStackEntry entry = stack[--top];
+        // skip nodes that start behind a hit found since they were pushed
+        if (q.far >= q.near && entry.tEntry > q.far)
+            continue;
 
-    //scene.objects
-    for (auto& object : candidates)
+        const LinearBVHNode& node = tree.nodes[entry.node];
+        if (node.objectCount > 0 && node.leafTriangles)
+        {
+            hitTriangles(tree.triangles, node.offset, node.objectCount, q);
+            continue;
+        }
+        if (node.objectCount > 0)
+        {
+            for (uint32_t i = node.offset; i < node.offset + node.objectCount; i++)
+            {
+                if (q.pick)
+                    std::cout << q.pick << "BVH traversal result: " << objectTypeName(tree.objects[i]->type) << std::endl;
+                hitObject(tree.objects[i], q);
+            }
+            continue;
+        }
+
+        const uint32_t left = entry.node + 1;
+        const uint32_t right = node.offset;
+        float tLeft, tRight;
+        bool hitLeft = ray_box(tree.nodes[left], q.e, invD, q.near, q.far, tLeft);
+        bool hitRight = ray_box(tree.nodes[right], q.e, invD, q.near, q.far, tRight);
+        q.stats.boxTests += 2;
+        // push the farther child first so the nearer one is expanded next; if the ray starts
+        // inside both, go by its direction along the split axis
+        if (hitLeft && hitRight)
+        {
+            bool leftFirst = tLeft < tRight || (tLeft == tRight && q.d[node.axis] >= 0.0f);
+            if (leftFirst)
+            {
+                stack[top++] = { right, tRight };
+                stack[top++] = { left, tLeft };
+            }
+            else
+            {
+                stack[top++] = { left, tLeft };
+                stack[top++] = { right, tRight };
+            }
+        }
+        else if (hitLeft)
+        {
+            stack[top++] = { left, tLeft };
+        }
+        else if (hitRight)
+        {
+            stack[top++] = { right, tRight };
+        }
+    }
+}
+
+// The same walk over the wide BVH: all of a node's children are tested together and the ones
+// that are hit are pushed farthest first. Leaves are pushed too, so they're tested in order.
+static void hitWide(const WideBVH &tree, HitQuery &q) {
+    const Vector invD(1.0f / q.d.x, 1.0f / q.d.y, 1.0f / q.d.z);
+    WideStackEntry stack[BVH_MAX_DEPTH * (BVH_WIDE - 1) + 1];
+    int top = 0;
+    stack[top++] = { 0, 0, 0, q.near };
+    while (top > 0)
     {
-        if (object->type == "sphere")
+        const WideStackEntry entry = stack[--top];
+        if (q.far >= q.near && entry.tEntry > q.far)
+            continue;
+
+        if (entry.objectCount > 0 && entry.triangles)
         {
-            Sphere* sphere = (Sphere*)(object);
-            t = ray_sphere(sphere, e, d, near, far, at, normal, pick, prefix);
+            hitTriangles(tree.triangles, entry.child, entry.objectCount, q);
+            continue;
         }
-        else if (object->type == "mTriangle")
+        if (entry.objectCount > 0)
         {
-            MTriangle* mTriangle = (MTriangle*)(object);
-            t = ray_triangle(mTriangle->triangle, e, d, near, far, at, normal, pick, prefix);
+            for (uint32_t i = entry.child; i < entry.child + entry.objectCount; i++)
+            {
+                if (q.pick)
+                    std::cout << q.pick << "BVH traversal result: " << objectTypeName(tree.objects[i]->type) << std::endl;
+                hitObject(tree.objects[i], q);
+            }
+            continue;
+        }
+
+        const WideBVHNode& node = tree.nodes[entry.child];
+        float tEntry[BVH_WIDE];
+        int mask = ray_box_wide(node, q.e, invD, q.near, q.far, tEntry);
+        q.stats.boxTests += node.childCount;
+
+        // sort the children that were hit by entry distance, nearest first
+        int order[BVH_WIDE];
+        int hits = 0;
+        for (int i = 0; i < BVH_WIDE; i++)
+        {
+            if (!(mask & (1 << i)))
+                continue;
+            int j = hits++;
+            while (j > 0 && tEntry[order[j - 1]] > tEntry[i])
+            {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
         }
-        else if (object->type == "plane")
+        for (int j = hits - 1; j >= 0; j--)
         {
-            Plane* plane = (Plane*)(object);
-            t = ray_plane(plane, e, d, near, far, at, normal, pick, prefix);
+            const int i = order[j];
+            stack[top++] = { node.child[i], node.objectCount[i], (uint8_t)((node.triangleLeaves >> i) & 1), tEntry[i] };
         }
-        else if (object->type == "mesh") {
-            Mesh* mesh = (Mesh*)(object);
-            t = ray_mesh(mesh, e, d, near, far, at, normal, pick, prefix);
+    }
+}
+
+// Trace the query's ray through an instance's mesh BVH, in the mesh's space. The direction is
+// transformed but not renormalised, so a distance t along it is the same in both spaces.
+static void hitInstance(Instance *instance, HitQuery &q) {
+    const Vertex e = instance->toObject.point(q.e);
+    const Vector d = instance->toObject.vector(q.d);
+    Vertex unusedAt;
+    Vector unusedNormal;
+    Object *unusedObject = NULL;
+    HitQuery local = { e, d, q.near, q.far, -1, unusedAt, unusedNormal, unusedObject, NULL, 0, q.pick, RayStats() };
+    if (!meshWideBvhs[instance->mesh].empty())
+    {
+        hitWide(meshWideBvhs[instance->mesh], local);
+    }
+    else if (!meshBvhs[instance->mesh].empty())
+    {
+        hitLinear(meshBvhs[instance->mesh], local);
+    }
+    q.stats += local.stats;
+
+    if (local.nearest_t > 0 && (q.nearest_t < 0 || local.nearest_t < q.nearest_t))
+    {
+        q.nearest_t = local.nearest_t;
+        q.far = local.nearest_t;
+        q.hit_object = instance;
+        q.hit_triangles = local.hit_triangles;
+        q.hit_triangle = local.hit_triangle;
+    }
+}
+
+// Closest-hit query: returns the nearest t in [near, far] (far < near means unbounded) and
+// fills in the hit point, normal and object, or returns -1 if nothing is hit.
+template <class Features>
+static float hit(const Vertex &e, const Vector &d, float near, float far, Vertex &hit_at, Vector &hit_normal, Object *&hit_object, const PickTrace &pick) {
+
+    HitQuery q = { e, d, near, far, -1, hit_at, hit_normal, hit_object, NULL, 0, pick, RayStats() };
+    q.stats.rays = 1;
+
+    if (!Features::bvh)
+    {
+        for (auto object : scene.objects)
+        {
+            hitObject(object, q);
         }
+        finishHit(q);
+        threadRayStats += q.stats;
+        return q.nearest_t;
+    }
+
+    // planes are unbounded, so they're kept out of the BVH and always tested; doing them first
+    // lets the nearest one cut the BVH walk short
+    hitPlanes(planes, q);
+
+    if (!wideBvh.empty())
+    {
+        hitWide(wideBvh, q);
+    }
+    else if (!bvh.empty())
+    {
+        hitLinear(bvh, q);
+    }
+
+    finishHit(q);
+    threadRayStats += q.stats;
+    return q.nearest_t;
+}
+
+// any-hit walks of the two BVH layouts for occlusion(); they return true once the light is fully blocked
+template <class Features>
+static bool occludeLinear(const LinearBVH &tree, const Object *instance, const Vertex &e, const Vector &d, float near, float far, RGB &opacity, RayStats &stats, const PickTrace &pick) {
+    const Vector invD(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+    uint32_t stack[BVH_MAX_DEPTH];
+    int top = 0;
+    float tEntry;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const uint32_t index = stack[--top];
+        const LinearBVHNode& node = tree.nodes[index];
+        stats.boxTests++;
+        if (!ray_box(node, e, invD, near, far, tEntry))
+            continue;
 
-        if (NULL != opacity_sum)
+        if (node.objectCount > 0 && node.leafTriangles)
+        {
+            if (occludeTriangles<Features>(tree.triangles, instance, node.offset, node.objectCount, e, d, near, far, opacity, stats, pick))
+                return true;
+            continue;
+        }
+        if (node.objectCount > 0)
         {
-            // if this is non-NULL, use it to send back the amount blocked by opacity (because we're in shadow), stopping at (1,1,1)
-            if (t >= near && (far < near || t <= far))
+            for (uint32_t i = node.offset; i < node.offset + node.objectCount; i++)
             {
-                // shadow hit
-                if (DISABLE_SHADOW_TRANSPARENCY)
+                if (occludeObject<Features>(tree.objects[i], e, d, near, far, opacity, stats))
                 {
-                    *opacity_sum = RGB(1, 1, 1);
-                    hit_object = object;
-                    return 1;
-                }
-                else
-                {
-                    RGB opacity = RGB(1, 1, 1) - object->material.transmissive;
-                    *opacity_sum += opacity;
-                    *opacity_sum = glm::clamp(*opacity_sum, 0.0f, 1.0f);
                     if (pick)
-                        //std::cout << prefix << "shadow adding opacity " << glm::to_string(opacity) << " to get sum " << glm::to_string(*opacity_sum) << std::endl;
-                    if (*opacity_sum == RGB(1, 1, 1))
-                    {
-                        return 1;
-                    }
+                        std::cout << pick << "shadowed by " << objectTypeName(tree.objects[i]->type) << std::endl;
+                    return true;
                 }
             }
+            continue;
         }
 
-        if (t > 0 && (nearest_t < 0 || t < nearest_t))
+        stack[top++] = node.offset;
+        stack[top++] = index + 1;
+    }
+    return false;
+}
+
+template <class Features>
+static bool occludeWide(const WideBVH &tree, const Object *instance, const Vertex &e, const Vector &d, float near, float far, RGB &opacity, RayStats &stats, const PickTrace &pick) {
+    const Vector invD(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+    uint32_t stack[BVH_MAX_DEPTH * (BVH_WIDE - 1) + 1];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const WideBVHNode& node = tree.nodes[stack[--top]];
+        float tEntry[BVH_WIDE];
+        int mask = ray_box_wide(node, e, invD, near, far, tEntry);
+        stats.boxTests += node.childCount;
+        for (int i = 0; i < node.childCount; i++)
         {
-            nearest_t = t;
-            if (NULL == opacity_sum)
+            if (!(mask & (1 << i)))
+                continue;
+            if (node.objectCount[i] == 0)
+            {
+                stack[top++] = node.child[i];
+                continue;
+            }
+            if (node.triangleLeaves & (1 << i))
             {
-                // if we're calculating shadow transparency, we can't skip anything
-                far = t;
+                if (occludeTriangles<Features>(tree.triangles, instance, node.child[i], node.objectCount[i], e, d, near, far, opacity, stats, pick))
+                    return true;
+                continue;
+            }
+            for (uint32_t j = node.child[i]; j < node.child[i] + node.objectCount[i]; j++)
+            {
+                if (occludeObject<Features>(tree.objects[j], e, d, near, far, opacity, stats))
+                {
+                    if (pick)
+                        std::cout << pick << "shadowed by " << objectTypeName(tree.objects[j]->type) << std::endl;
+                    return true;
+                }
             }
-            hit_at = at;
-            hit_normal = normal;
-            hit_object = object;
         }
     }
+    return false;
+}
 
-    return nearest_t;
+// The any-hit walk of an instance's mesh BVH, in the mesh's space as for hitInstance()
+template <class Features>
+static bool occludeInstance(const Instance *instance, const Vertex &e, const Vector &d, float near, float far, RGB &opacity, RayStats &stats) {
+    const PickTrace noPick = { false, NULL, "" };
+    const Vertex objectE = instance->toObject.point(e);
+    const Vector objectD = instance->toObject.vector(d);
+    if (!meshWideBvhs[instance->mesh].empty())
+    {
+        return occludeWide<Features>(meshWideBvhs[instance->mesh], instance, objectE, objectD, near, far, opacity, stats, noPick);
+    }
+    return !meshBvhs[instance->mesh].empty()
+        && occludeLinear<Features>(meshBvhs[instance->mesh], instance, objectE, objectD, near, far, opacity, stats, noPick);
+}
+
+// Any-hit query for shadow rays: how much of the light along [near, far] is blocked, from
+// (0,0,0) to (1,1,1). Only transmissive occluders let the search continue; the first opaque
+// one ends it. No hit points or normals are computed, and the BVH is walked in any order.
+template <class Features>
+static RGB occlusion(const Vertex &e, const Vector &d, float near, float far, const PickTrace &pick) {
+    RGB opacity(0, 0, 0);
+    RayStats stats;
+    stats.rays = 1;
+    stats.shadowRays = 1;
+
+    if (!Features::bvh)
+    {
+        for (auto object : scene.objects)
+        {
+            if (occludeObject<Features>(object, e, d, near, far, opacity, stats))
+                break;
+        }
+        threadRayStats += stats;
+        return opacity;
+    }
+
+    bool blocked = occludePlanes<Features>(planes, e, d, near, far, opacity, stats, pick);
+
+    if (!blocked && !wideBvh.empty())
+    {
+        occludeWide<Features>(wideBvh, NULL, e, d, near, far, opacity, stats, pick);
+    }
+    else if (!blocked && !bvh.empty())
+    {
+        occludeLinear<Features>(bvh, NULL, e, d, near, far, opacity, stats, pick);
+    }
+
+    threadRayStats += stats;
+    return opacity;
 }
 
-RGB reflect(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm, int r_depth, bool pick, std::string prefix) {
+template <class Features>
+static RGB reflect(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm, int r_depth, Rng &rng, const PickTrace &pick) {
   RGB reflect_colour;
 
   Vector v = glm::normalize(e - at);
@@ -345,21 +1145,21 @@ RGB reflect(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm,
   Vector hit_normal;
   Object *hit_object = NULL;
 
-  //if (pick) std::cout << prefix << "check reflection from " << glm::to_string(at) << " going " << glm::to_string(r) << std::endl;
-  t = hit(at, r, SELF_HIT, 0, hit_at, hit_normal, hit_object, NULL, pick, prefix + " ");
+  //if (pick) std::cout << pick << "check reflection from " << glm::to_string(at) << " going " << glm::to_string(r) << std::endl;
+  t = hit<Features>(at, r, SELF_HIT, 0, hit_at, hit_normal, hit_object, pick.then(" "));
 
   if (t >= SELF_HIT) {
-    reflect_colour = light(hit_object, at, hit_at, hit_normal, r_depth + 1, pick, prefix);
-    //if (pick) std::cout << prefix << " reflection on " << obj->type << " colour " << glm::to_string(reflect_colour) << std::endl;
+    reflect_colour = light<Features>(hit_object, at, hit_at, hit_normal, r_depth + 1, rng, pick);
+    //if (pick) std::cout << pick << " reflection on " << objectTypeName(obj->type) << " colour " << glm::to_string(reflect_colour) << std::endl;
   } else {
     reflect_colour = background_colour;
-    //if (pick) std::cout << prefix << " no reflection r=" << glm::to_string(r) << " t=" << t << std::endl;
+    //if (pick) std::cout << pick << " no reflection r=" << glm::to_string(r) << " t=" << t << std::endl;
   }
   
   return reflect_colour;
 }
 
-bool refract(const Vector &r, const Vector &snorm, float index_of_refraction, Vector &refracted, bool pick, std::string prefix) {
+bool refract(const Vector &r, const Vector &snorm, float index_of_refraction, Vector &refracted, const PickTrace &pick) {
   float eta_i, eta_r;
   Vector n = snorm;
   Vector vi = glm::normalize(r);
@@ -368,29 +1168,29 @@ bool refract(const Vector &r, const Vector &snorm, float index_of_refraction, Ve
   if (vi_dot_n < 0) {
     eta_i = 1;
     eta_r = index_of_refraction;
-    //if (pick) std::cout << prefix << "refraction, entering the object\n";
+    //if (pick) std::cout << pick << "refraction, entering the object\n";
   } else {
     eta_i = index_of_refraction;
     eta_r = 1;
     n = -snorm;
     vi_dot_n = -vi_dot_n;
-    //if (pick) std::cout << prefix << "refraction, leaving the object\n";
+    //if (pick) std::cout << pick << "refraction, leaving the object\n";
   }
   
   float radicand = 1 - (eta_i * eta_i) * (1 - vi_dot_n * vi_dot_n) / (eta_r * eta_r);
   if (radicand >= 0) {
     refracted = eta_i * (vi - n * vi_dot_n) / eta_r - n * sqrt(radicand);
-    //if (pick) std::cout << prefix << " refracting path from " << glm::to_string(r) << " to " << glm::to_string(refracted) << std::endl;
+    //if (pick) std::cout << pick << " refracting path from " << glm::to_string(r) << " to " << glm::to_string(refracted) << std::endl;
     return true;
   } else {
     vi = -vi;
     refracted = 2 * glm::dot(n, vi) * n - vi;
-    //if (pick) std::cout << prefix << " total internal reflection from " << glm::to_string(r) << " to " << glm::to_string(refracted) << std::endl;
+    //if (pick) std::cout << pick << " total internal reflection from " << glm::to_string(r) << " to " << glm::to_string(refracted) << std::endl;
     return false;
   }
 }
 
-bool schlickRefract(Object* obj, const Vector& r, const Vector& snorm, float index_of_refraction, Vector& refracted, bool pick, std::string prefix) {
+bool schlickRefract(Object* obj, const Vector& r, const Vector& snorm, float index_of_refraction, Vector& refracted, Rng& rng, const PickTrace &pick) {
     
     bool result = false;
 
@@ -406,20 +1206,21 @@ bool schlickRefract(Object* obj, const Vector& r, const Vector& snorm, float ind
     r0 = r0 * r0;
     float reflectance = r0 + (1 - r0) * std::pow((1 - cosTheta), 5);
 
-    if (cannotRefract || reflectance > randomFloat()) {
+    if (cannotRefract || reflectance > randomFloat(rng)) {
         result = false;
     }
     else {
         result = true;
-        refract(r, snorm, refractionRatio, refracted, pick, prefix);
+        refract(r, snorm, refractionRatio, refracted, pick);
     }
 
     return result;
 }
 
-RGB transmit(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm, int r_depth, bool pick, std::string prefix) {
+template <class Features>
+static RGB transmit(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm, int r_depth, Rng &rng, const PickTrace &pick) {
   RGB transmit_colour;
-  const Material &mat = obj->material;
+  const Material &mat = scene.materials[obj->material];
 
   Vector vi = glm::normalize(at-e), vr = vi;
   float t;
@@ -428,48 +1229,49 @@ RGB transmit(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm
   Vector hit_normal;
   Object *hit_object = NULL;
 
-  if (mat.refraction > 0 && !DISABLE_REFRACTION) {
-    if (!DISABLE_SCHLICKREFRACTION) {
-        schlickRefract(obj, vi, snorm, mat.refraction, vr, pick, prefix);
+  if (mat.refraction > 0 && Features::refraction) {
+    if (Features::schlick) {
+        schlickRefract(obj, vi, snorm, mat.refraction, vr, rng, pick);
     }
     else {
-        refract(vi, snorm, mat.refraction, vr, pick, prefix);
+        refract(vi, snorm, mat.refraction, vr, pick);
     }
   }
 
-  t = hit(at, vr, SELF_HIT, 0, hit_at, hit_normal, hit_object, NULL, pick, prefix);
+  t = hit<Features>(at, vr, SELF_HIT, 0, hit_at, hit_normal, hit_object, pick);
   if (t >= SELF_HIT) {
-    transmit_colour = light(hit_object, at, hit_at, hit_normal, r_depth + 1, pick, prefix + " ");
-    //if (pick) std::cout << prefix << "transmission to " << obj->type << " colour " << glm::to_string(transmit_colour) << std::endl;
+    transmit_colour = light<Features>(hit_object, at, hit_at, hit_normal, r_depth + 1, rng, pick.then(" "));
+    //if (pick) std::cout << pick << "transmission to " << objectTypeName(obj->type) << " colour " << glm::to_string(transmit_colour) << std::endl;
   } else {
     transmit_colour = background_colour;
-    //if (pick) std::cout << prefix << "no transmission t=" << t << std::endl;
+    //if (pick) std::cout << pick << "no transmission t=" << t << std::endl;
   }
 
   return transmit_colour;
 }
 
-RGB light(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm, int r_depth, bool pick, std::string prefix) {
+template <class Features>
+static RGB light(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm, int r_depth, Rng &rng, const PickTrace &caller) {
   RGB reflect_colour, transmit_colour, direct_colour;
-  const Material &mat = obj->material;
+  const Material &mat = scene.materials[obj->material];
   
-  prefix += "+";
+  const PickTrace pick = caller.then("+");
 
-  if (glm::length(mat.reflective) > 0 && r_depth < MAX_R_DEPTH && !DISABLE_REFLECTION) {
-    reflect_colour = reflect(obj, e, at, snorm, r_depth, pick, prefix);
+  if (glm::length(mat.reflective) > 0 && r_depth < MAX_R_DEPTH && Features::reflection) {
+    reflect_colour = reflect<Features>(obj, e, at, snorm, r_depth, rng, pick);
   }
 
-  if (glm::length(mat.transmissive) > 0 && r_depth < MAX_R_DEPTH && !DISABLE_TRANSMISSION) {
-    transmit_colour = transmit(obj, e, at, snorm, r_depth, pick, prefix);
+  if (glm::length(mat.transmissive) > 0 && r_depth < MAX_R_DEPTH && Features::transmission) {
+    transmit_colour = transmit<Features>(obj, e, at, snorm, r_depth, rng, pick);
   }
 
   for (auto &&light : scene.lights) {
 
-		if (light->type == "ambient") {
+		if (light->type == LightType::Ambient) {
           AmbientLight *a = (AmbientLight *)(light);
-          if (!DISABLE_AMBIENT) {
+          if (Features::ambient) {
   			    direct_colour += a->color * mat.ambient;
-            //if (pick) std::cout << prefix << "ambient lit a " << obj->type << " " << glm::to_string(a->color * mat.ambient) << std::endl;
+            //if (pick) std::cout << pick << "ambient lit a " << objectTypeName(obj->type) << " " << glm::to_string(a->color * mat.ambient) << std::endl;
           }
 
 		} else {
@@ -478,23 +1280,26 @@ RGB light(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm, i
       float tfar = 0;
       Vector l;
 
-  		if (light->type == "directional") {
+      switch (light->type) {
+      case LightType::Directional: {
         DirectionalLight *d = (DirectionalLight *)(light);
 
         l = -glm::normalize(d->direction);
-        //if (pick) std::cout << prefix << "check directional " << glm::to_string(d->direction) << std::endl;
+        //if (pick) std::cout << pick << "check directional " << glm::to_string(d->direction) << std::endl;
         maybe_lit = true;
-
-      } else if (light->type == "point") {
+        break;
+      }
+      case LightType::Point: {
         PointLight *p = (PointLight *)(light);
 
   			l = p->position - at;
   			tfar = glm::length(l);
-        //if (pick) std::cout << prefix << "check point " << glm::to_string(p->position) << " going " << glm::to_string(l) << std::endl;
+        //if (pick) std::cout << pick << "check point " << glm::to_string(p->position) << " going " << glm::to_string(l) << std::endl;
         l = glm::normalize(l);
         maybe_lit = true;
-
-      } else if (light->type == "spot") {
+        break;
+      }
+      case LightType::Spot: {
         SpotLight *s = (SpotLight *)(light);
         
   			Vector l_orig = s->position - at;
@@ -502,31 +1307,31 @@ RGB light(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm, i
         l = glm::normalize(l_orig);
   			Vector dir = -glm::normalize(s->direction);
         if (acos(glm::dot(l, dir)) <= PI * double(s->cutoff) / 180.0) {
-          //if (pick) std::cout << prefix << "check spot " << glm::to_string(s->position) << " going " << glm::to_string(l_orig) << std::endl;
+          //if (pick) std::cout << pick << "check spot " << glm::to_string(s->position) << " going " << glm::to_string(l_orig) << std::endl;
           maybe_lit = true;
         }
+        break;
+      }
+      default:
+        break;
       }
 
       if (maybe_lit) {
-        float t = -1;
-        Object *shadowing_obj = NULL;
         RGB shadow_opacity(0,0,0);
 
-        if (!DISABLE_SHADOW) {
-          //if (pick) std::cout << prefix << " check shadow from " << glm::to_string(at) << " going " << glm::to_string(l) << " max t=" << tfar << std::endl;
-
-          Vector unused_v;
-          t = hit(at, l, SELF_HIT, tfar, unused_v, unused_v, shadowing_obj, &shadow_opacity, pick, prefix + "  ");
+        if (Features::shadows) {
+          //if (pick) std::cout << pick << " check shadow from " << glm::to_string(at) << " going " << glm::to_string(l) << " max t=" << tfar << std::endl;
+          shadow_opacity = occlusion<Features>(at, l, SELF_HIT, tfar, pick.then("  "));
         }
 
-        if (t > SELF_HIT && DISABLE_SHADOW_TRANSPARENCY) {
-          //if (pick) std::cout << prefix << "  shadowed by " << shadowing_obj->type << std::endl;
+        if (!Features::shadowTransparency && shadow_opacity == RGB(1, 1, 1)) {
+          //if (pick) std::cout << pick << "  shadowed\n";
         } else {
-          if (pick && !DISABLE_SHADOW) {
-            if (DISABLE_SHADOW_TRANSPARENCY) {
-              //std::cout << prefix << "  no shadow\n";
+          if (pick && Features::shadows) {
+            if (!Features::shadowTransparency) {
+              //std::cout << pick << "  no shadow\n";
             } else {
-              //std::cout << prefix << "  shadow opacity amount=" << glm::to_string(shadow_opacity) << std::endl;
+              //std::cout << pick << "  shadow opacity amount=" << glm::to_string(shadow_opacity) << std::endl;
             }
           }
 
@@ -535,23 +1340,23 @@ RGB light(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm, i
           Vector v = glm::normalize(e - at);
           Vector n = snorm;
           float dot = glm::dot(snorm, l);
-          if (dot < 0 && ALLOW_HIT_MESH_BACK && (obj->type == "mesh" || obj->type == "mTriangle")) {
+          if (dot < 0 && ALLOW_HIT_MESH_BACK && (obj->type == ObjectType::Mesh || obj->type == ObjectType::Instance)) {
             n = -snorm;
             dot = -dot;
           }
           if (dot > 0) {
-            if (!DISABLE_DIFFUSE) {
+            if (Features::diffuse) {
               this_light_colour += glm::clamp(c * mat.diffuse * dot, 0.0f, 1.0f);
             }
             Vector r = 2 * dot * n - l;
             float rdotv = glm::dot(r, v);
-            if (rdotv > 0 && !DISABLE_SPECULAR) {
+            if (rdotv > 0 && Features::specular) {
               this_light_colour += glm::clamp(c * mat.specular * float(pow(rdotv, mat.shininess)), 0.0f, 1.0f);
             }
-            if (!DISABLE_SHADOW_TRANSPARENCY) {
+            if (Features::shadowTransparency) {
               this_light_colour *= (RGB(1,1,1) - shadow_opacity);
             }
-            //if (pick) std::cout << prefix << light->type << " lit " << glm::to_string(this_light_colour) << " from " << glm::to_string(l) << std::endl;
+            //if (pick) std::cout << pick << lightTypeName(light->type) << " lit " << glm::to_string(this_light_colour) << " from " << glm::to_string(l) << std::endl;
             direct_colour = glm::clamp(direct_colour + this_light_colour, 0.0f, 1.0f);
           }
         }
@@ -569,17 +1374,31 @@ RGB light(Object *obj, const Vertex &e, const Vertex &at, const Vector &snorm, i
   }
   colour = glm::clamp(colour, 0.0f, 1.0f);
 
-  //if (pick) std::cout << prefix << "final colour " << glm::to_string(colour) << std::endl;
+  //if (pick) std::cout << pick << "final colour " << glm::to_string(colour) << std::endl;
   
   return colour;
 }
 
-bool ssTrace(const Vertex& e, const std::vector<Vector>& ss, RGB& colour, bool pick) {
+// hit() for a ray from the eye, keeping separate counts for primary rays
+template <class Features>
+static float primaryHit(const Vertex &e, const Vector &d, Vertex &hit_at, Vector &hit_normal, Object *&hit_object, const PickTrace &pick) {
+    const RayStats before = threadRayStats;
+    float t = hit<Features>(e, d, 1.0f, 0.0f, hit_at, hit_normal, hit_object, pick);
+    threadRayStats.primaryRays++;
+    threadRayStats.primaryBoxTests += threadRayStats.boxTests - before.boxTests;
+    threadRayStats.primaryTriangleTests += threadRayStats.triangleTests - before.triangleTests;
+    return t;
+}
+
+template <class Features>
+static bool ssTraceWith(const Vertex& e, const ViewPlaneSamples& ss, RGB& colour, Rng& rng, bool pick) {
+    const PickTrace trace = { pick, NULL, "" };
     bool traceResult = false;
     RGB totalColor = RGB(0,0,0);
     int totalValidTrace = 0;
     int totalInvalidTrace = 0;
-    std::vector<Object*> totalHitObjs;
+    Object* totalHitObjs[4];
+    int totalHitCount = 0;
     for (int i = 0; i < 4; i++) {
         Vector d = ss.at(i) - e;
         d = glm::normalize(d);
@@ -587,12 +1406,12 @@ bool ssTrace(const Vertex& e, const std::vector<Vector>& ss, RGB& colour, bool p
         Vertex hit_at;
         Vector hit_normal;
         Object* hit_object = NULL;
-        t = hit(e, d, 1.0f, 0.0f, hit_at, hit_normal, hit_object, NULL, pick, "");
+        t = primaryHit<Features>(e, d, hit_at, hit_normal, hit_object, trace);
         if (t >= 1.0) {
             traceResult = true;
             totalValidTrace++;
-            totalColor += light(hit_object, e, hit_at, hit_normal, 0, pick, "");
-            totalHitObjs.push_back(hit_object);
+            totalColor += light<Features>(hit_object, e, hit_at, hit_normal, 0, rng, trace);
+            totalHitObjs[totalHitCount++] = hit_object;
         }
         else {
             totalInvalidTrace++;
@@ -600,11 +1419,11 @@ bool ssTrace(const Vertex& e, const std::vector<Vector>& ss, RGB& colour, bool p
         }
     }
     if (traceResult) {
-        if (!DISABLE_TOON_SHADING) {
-            if (!DISABLE_OUTLINE_SHADING) {
+        if (Features::toon != ToonStyle::None) {
+            if (Features::toon == ToonStyle::Outline) {
                 colour = RGB(1.0, 1.0, 1.0);
             }
-            else if (!DISABLE_SKETCH_SHADING) {
+            else if (Features::toon == ToonStyle::Sketch) {
                 float maxColor = std::min(totalColor.r, totalColor.g);
                 maxColor = std::min(maxColor, totalColor.b);
                 colour = RGB(maxColor, maxColor, maxColor);
@@ -617,8 +1436,8 @@ bool ssTrace(const Vertex& e, const std::vector<Vector>& ss, RGB& colour, bool p
             {
                 colour = RGB(0.0f, 0.0f, 0.0f);
             }
-            else if (totalHitObjs.size() == 4) {
-                if (totalHitObjs.at(0) != totalHitObjs.at(1) || totalHitObjs.at(0) != totalHitObjs.at(2) || totalHitObjs.at(0) != totalHitObjs.at(3) || totalHitObjs.at(1) != totalHitObjs.at(2) || totalHitObjs.at(1) != totalHitObjs.at(3) || totalHitObjs.at(2) != totalHitObjs.at(3)) {
+            else if (totalHitCount == 4) {
+                if (totalHitObjs[0] != totalHitObjs[1] || totalHitObjs[0] != totalHitObjs[2] || totalHitObjs[0] != totalHitObjs[3] || totalHitObjs[1] != totalHitObjs[2] || totalHitObjs[1] != totalHitObjs[3] || totalHitObjs[2] != totalHitObjs[3]) {
                     colour = RGB(0.0f, 0.0f, 0.0f);
                 }
             }
@@ -630,7 +1449,9 @@ bool ssTrace(const Vertex& e, const std::vector<Vector>& ss, RGB& colour, bool p
     return traceResult;
 }
 
-bool trace(const Vertex &e, const Vertex &s, RGB &colour, bool pick) {
+template <class Features>
+static bool traceWith(const Vertex &e, const Vertex &s, RGB &colour, Rng &rng, bool pick) {
+  const PickTrace trace = { pick, NULL, "" };
   Vector d = s - e;
   d = glm::normalize(d);
   float t;
@@ -638,13 +1459,50 @@ bool trace(const Vertex &e, const Vertex &s, RGB &colour, bool pick) {
   Vector hit_normal;
   Object *hit_object = NULL;
 
-  t = hit(e, d, 1.0f, 0.0f, hit_at, hit_normal, hit_object, NULL, pick, "");
+  t = primaryHit<Features>(e, d, hit_at, hit_normal, hit_object, trace);
 
   if (t >= 1.0) {
     // light it up if there was a hit
-    colour = light(hit_object, e, hit_at, hit_normal, 0, pick, "");
+    colour = light<Features>(hit_object, e, hit_at, hit_normal, 0, rng, trace);
     return true;
   }
 
   return false;
-}
\ No newline at end of file
+}
+
+// Each mode is a separately compiled kernel; the switch only picks which one a ray runs
+bool ssTrace(const Vertex& e, const ViewPlaneSamples& ss, RGB& colour, Rng& rng, bool pick, ShadingMode mode) {
+  switch (mode) {
+  case ShadingMode::Preview:
+    return ssTraceWith<PreviewFeatures>(e, ss, colour, rng, pick);
+  case ShadingMode::BruteForce:
+    return ssTraceWith<BruteForceFeatures>(e, ss, colour, rng, pick);
+  case ShadingMode::Toon:
+    return ssTraceWith<ToonFeatures>(e, ss, colour, rng, pick);
+  case ShadingMode::Outline:
+    return ssTraceWith<OutlineFeatures>(e, ss, colour, rng, pick);
+  case ShadingMode::Sketch:
+    return ssTraceWith<SketchFeatures>(e, ss, colour, rng, pick);
+  case ShadingMode::Final:
+  default:
+    return ssTraceWith<FinalFeatures>(e, ss, colour, rng, pick);
+  }
+}
+
+bool trace(const Vertex &e, const Vertex &s, RGB &colour, Rng &rng, bool pick, ShadingMode mode) {
+  switch (mode) {
+  case ShadingMode::Preview:
+    return traceWith<PreviewFeatures>(e, s, colour, rng, pick);
+  case ShadingMode::BruteForce:
+    return traceWith<BruteForceFeatures>(e, s, colour, rng, pick);
+  case ShadingMode::Toon:
+    return traceWith<ToonFeatures>(e, s, colour, rng, pick);
+  case ShadingMode::Outline:
+    return traceWith<OutlineFeatures>(e, s, colour, rng, pick);
+  case ShadingMode::Sketch:
+    return traceWith<SketchFeatures>(e, s, colour, rng, pick);
+  case ShadingMode::Final:
+  default:
+    return traceWith<FinalFeatures>(e, s, colour, rng, pick);
+  }
+}
@@ -1,17 +1,89 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <glm/glm.hpp>
 #include "schema.h"
+#include "bvh.h"
+#include "rng.h"
 
 typedef glm::vec3 point3;
 typedef glm::vec3 colour3;
 
-const bool DISABLE_TOON_SHADING = true;
+// Which shading kernel trace()/ssTrace() run. Each is compiled separately with only its own
+// features, so one process can render preview and final-quality jobs side by side.
+enum class ShadingMode {
+    Final,      // everything: shadows through transparent objects, reflection, refraction with Schlick's approximation
+    Preview,    // direct lighting with opaque shadows; no reflection or transmission
+    BruteForce, // as Final, but every ray tests every object instead of using the BVH
+    Toon,       // as Final, antialiased samples averaged with dark outlines where they disagree
+    Outline,    // white, with dark outlines
+    Sketch      // grey from each pixel's darkest channel, with dark outlines
+};
+
+// the toon modes spread their supersamples wider, to find the outlines
+inline bool toonShading(ShadingMode mode) {
+    return mode == ShadingMode::Toon || mode == ShadingMode::Outline || mode == ShadingMode::Sketch;
+}
+
+// Counters for the ray queries made by one thread
+struct RayStats {
+    uint64_t primaryRays;       // rays from the eye
+    uint64_t rays;              // all intersection queries: primary, reflected, transmitted and shadow
+    uint64_t shadowRays;        // the part of rays that were shadow (occlusion) queries
+    uint64_t boxTests;          // BVH node bounds tested
+    uint64_t primitiveTests;    // objects tested (a whole mesh counts once)
+    uint64_t triangleTests;     // triangles tested, including each triangle of a brute-force mesh
+    uint64_t primaryBoxTests;   // the part of boxTests made by primary rays
+    uint64_t primaryTriangleTests;  // the part of triangleTests made by primary rays
+
+    RayStats() : primaryRays(0), rays(0), shadowRays(0), boxTests(0), primitiveTests(0), triangleTests(0), primaryBoxTests(0), primaryTriangleTests(0) {}
+
+    RayStats& operator+=(const RayStats& o) {
+        primaryRays += o.primaryRays;
+        rays += o.rays;
+        shadowRays += o.shadowRays;
+        boxTests += o.boxTests;
+        primitiveTests += o.primitiveTests;
+        triangleTests += o.triangleTests;
+        primaryBoxTests += o.primaryBoxTests;
+        primaryTriangleTests += o.primaryTriangleTests;
+        return *this;
+    }
+};
 
 extern double fov;
 extern colour3 background_colour;
 
-float randomFloat();
-void choose_scene(char const *fn);
-bool ssTrace(const Vertex& e, const std::vector<Vector>& ss, RGB& colour, bool pick);
-bool trace(const point3 &e, const point3 &s, colour3 &colour, bool pick);
+float randomFloat(Rng &rng);
+// Loads scenes/<fn>.json and builds its BVH, or with useCache, loads scenes/<fn>.rtscene instead
+// when that is up to date and holds a BVH built with bvhOptions (see scenecache.h)
+void choose_scene(char const *fn, const BVHBuildOptions &bvhOptions = BVHBuildOptions(), bool useCache = true);
+// write the scene choose_scene() loaded, and its BVH, to scenes/<fn>.rtscene; false if that fails
+bool save_scene_cache(char const *fn);
+// the BVH built by choose_scene() (empty if the scene has nothing to put in it)
+const LinearBVH &scene_bvh();
+// the wide BVH built instead when choose_scene() was asked for BVHLayout::Wide (otherwise empty)
+const WideBVH &scene_wide_bvh();
+// the bottom-level BVHs of the meshes instances share, one per Scene::meshes entry, in the
+// layout scene_bvh()/scene_wide_bvh() uses (the other's trees are empty)
+const std::vector<LinearBVH> &scene_mesh_bvhs();
+const std::vector<WideBVH> &scene_mesh_wide_bvhs();
+// the scene choose_scene() loaded, for moving its objects: spheres, planes, mesh vertices and
+// instances (Instance::place()), but not adding or removing any
+Scene &loaded_scene();
+// Bring the BVHs up to date after objects of loaded_scene() have moved. Each tree is refit (see
+// refitBVH()), or rebuilt if refitting leaves its SAH cost more than rebuildRatio times what
+// it was when built. Pass meshesMoved = false if none of the meshes instances share have changed,
+// so their trees are left alone. Returns true if any tree was rebuilt.
+bool refit_scene(float rebuildRatio = BVH_REBUILD_RATIO, bool meshesMoved = true);
+
+// the four view plane positions ssTrace() averages, kept by value so no pixel allocates
+typedef std::array<Vector, 4> ViewPlaneSamples;
+
+// trace()/ssTrace() only read the scene, so once choose_scene() (or refit_scene()) has returned
+// they may run concurrently
+bool ssTrace(const Vertex& e, const ViewPlaneSamples& ss, RGB& colour, Rng& rng, bool pick, ShadingMode mode = ShadingMode::Final);
+bool trace(const point3 &e, const point3 &s, colour3 &colour, Rng &rng, bool pick, ShadingMode mode = ShadingMode::Final);
+// the calling thread's counters; callers reset and read them around a batch of trace() calls
+RayStats& rayStats();
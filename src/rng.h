@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+// PCG32 random number generator (https://www.pcg-random.org/), small enough to keep one per
+// thread or per pixel. Sampling code takes an Rng& explicitly instead of sharing rand()'s global state.
+struct Rng {
+    uint64_t state;
+    uint64_t inc;
+
+    Rng(uint64_t seed, uint64_t stream = 0) : state(0), inc((stream << 1u) | 1u) {
+        next();
+        state += seed;
+        next();
+    }
+
+    uint32_t next() {
+        uint64_t oldstate = state;
+        state = oldstate * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = (uint32_t)(((oldstate >> 18u) ^ oldstate) >> 27u);
+        uint32_t rot = (uint32_t)(oldstate >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+    // uniform in [0,1)
+    float nextFloat() {
+        return (next() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // Generator for pixel (x, y) of a given frame. Every pixel gets its own sequence, so a
+    // render is identical no matter how many threads draw it or in what order.
+    static Rng forPixel(int x, int y, uint32_t frame = 0) {
+        // splitmix64 finaliser, so neighbouring pixels don't start on neighbouring states
+        uint64_t z = ((uint64_t)(uint32_t)y << 32 | (uint32_t)x) + 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z = z ^ (z >> 31);
+        return Rng(z, frame);
+    }
+};
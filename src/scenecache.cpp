@@ -0,0 +1,487 @@
+#include "scenecache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char SCENE_CACHE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+
+// every section starts on this boundary, so the arrays in a mapped file are aligned for SSE loads
+const size_t SCENE_CACHE_ALIGN = 16;
+
+struct SceneCacheHeader {
+    char magic[8];
+    uint32_t version;
+    // sizes of the structs that are stored exactly as they are in memory
+    uint32_t headerBytes;
+    uint32_t materialBytes;
+    uint32_t vertexBytes;
+    uint32_t linearNodeBytes;
+    uint32_t wideNodeBytes;
+
+    // how the BVH was built
+    uint8_t builder;
+    uint8_t layout;
+    uint16_t pad;
+    int32_t sahBins;
+    int32_t maxLeafSize;
+
+    float field;
+    float background[3];
+
+    // the length of each section, in the order they follow the header
+    uint32_t materials;
+    uint32_t objects;
+    uint32_t lights;
+    uint32_t meshVertices;      // every mesh's vertices, one mesh after another
+    uint32_t meshIndices;       // and their triangles' indices, likewise
+    uint32_t nodes;             // LinearBVHNode or WideBVHNode, by layout
+    uint32_t leafObjects;       // indices into the objects
+    uint32_t triangles;         // the BVH's TriangleBuffer, one section per array
+    uint32_t triangleMeshes;    // indices into the objects
+
+    BVHBuildStats build;
+};
+
+struct CachedObject {
+    uint32_t type;
+    uint32_t material;
+    float radius;               // spheres
+    float position[3];          // spheres and planes
+    float normal[3];            // planes
+    uint32_t firstVertex;       // meshes: their range of the mesh vertices
+    uint32_t vertexCount;
+    uint32_t firstIndex;        // and of the mesh indices
+    uint32_t indexCount;
+};
+
+struct CachedLight {
+    uint32_t type;
+    float color[3];
+    float position[3];          // point and spot lights
+    float direction[3];         // directional and spot lights
+    float cutoff;               // spot lights
+};
+
+static void toFloats(const glm::vec3& v, float out[3]) {
+    out[0] = v.x;
+    out[1] = v.y;
+    out[2] = v.z;
+}
+
+static glm::vec3 fromFloats(const float v[3]) {
+    return glm::vec3(v[0], v[1], v[2]);
+}
+
+// write bytes, then zeros up to the next SCENE_CACHE_ALIGN boundary
+static void writeSection(std::ofstream& out, const void* data, size_t bytes) {
+    static const char zeros[SCENE_CACHE_ALIGN] = {};
+    if (bytes > 0) {
+        out.write((const char*)data, bytes);
+    }
+    out.write(zeros, (SCENE_CACHE_ALIGN - bytes % SCENE_CACHE_ALIGN) % SCENE_CACHE_ALIGN);
+}
+
+template <typename T>
+static void writeSection(std::ofstream& out, const std::vector<T>& v, size_t count) {
+    writeSection(out, v.data(), count * sizeof(T));
+}
+
+bool writeSceneCache(const std::string& fn, const Scene& scene, const BVHBuildOptions& options, const LinearBVH& bvh, const WideBVH& wide) {
+    // instances are traced through BVHs of their own, which the file has no sections for
+    if (!scene.meshes.empty()) {
+        std::cout << "*** scene caches can't hold instanced meshes yet" << std::endl;
+        return false;
+    }
+    const bool wideLayout = options.layout == BVHLayout::Wide;
+    const TriangleBuffer& tb = wideLayout ? wide.triangles : bvh.triangles;
+    const std::vector<Object*>& leaves = wideLayout ? wide.objects : bvh.objects;
+
+    std::unordered_map<const Object*, uint32_t> objectIndex;
+    std::vector<CachedObject> objects;
+    std::vector<Vertex> meshVertices;
+    std::vector<uint32_t> meshIndices;
+    for (size_t i = 0; i < scene.objects.size(); i++) {
+        const Object* o = scene.objects[i];
+        objectIndex[o] = (uint32_t)i;
+        CachedObject c;
+        memset(&c, 0, sizeof(c));
+        c.type = (uint32_t)o->type;
+        c.material = o->material;
+        if (o->type == ObjectType::Sphere) {
+            c.radius = ((const Sphere*)o)->radius;
+            toFloats(((const Sphere*)o)->position, c.position);
+        } else if (o->type == ObjectType::Plane) {
+            toFloats(((const Plane*)o)->position, c.position);
+            toFloats(((const Plane*)o)->normal, c.normal);
+        } else if (o->type == ObjectType::Mesh) {
+            const Mesh* m = (const Mesh*)o;
+            c.firstVertex = (uint32_t)meshVertices.size();
+            c.vertexCount = (uint32_t)m->vertices.size();
+            c.firstIndex = (uint32_t)meshIndices.size();
+            c.indexCount = (uint32_t)m->indices.size();
+            meshVertices.insert(meshVertices.end(), m->vertices.begin(), m->vertices.end());
+            meshIndices.insert(meshIndices.end(), m->indices.begin(), m->indices.end());
+        }
+        objects.push_back(c);
+    }
+
+    std::vector<CachedLight> lights;
+    for (const Light* l : scene.lights) {
+        CachedLight c;
+        memset(&c, 0, sizeof(c));
+        c.type = (uint32_t)l->type;
+        toFloats(l->color, c.color);
+        if (l->type == LightType::Directional) {
+            toFloats(((const DirectionalLight*)l)->direction, c.direction);
+        } else if (l->type == LightType::Point) {
+            toFloats(((const PointLight*)l)->position, c.position);
+        } else if (l->type == LightType::Spot) {
+            const SpotLight* s = (const SpotLight*)l;
+            toFloats(s->position, c.position);
+            toFloats(s->direction, c.direction);
+            c.cutoff = s->cutoff;
+        }
+        lights.push_back(c);
+    }
+
+    std::vector<uint32_t> leafObjects;
+    for (const Object* o : leaves) {
+        leafObjects.push_back(objectIndex.at(o));
+    }
+    std::vector<uint32_t> triangleMeshes;
+    for (const Mesh* m : tb.meshes) {
+        triangleMeshes.push_back(objectIndex.at(m));
+    }
+
+    SceneCacheHeader h;
+    memset((void*)&h, 0, sizeof(h));    // padding included, so the same scene always writes the same bytes
+    memcpy(h.magic, SCENE_CACHE_MAGIC, sizeof(h.magic));
+    h.version = SCENE_CACHE_VERSION;
+    h.headerBytes = sizeof(SceneCacheHeader);
+    h.materialBytes = sizeof(Material);
+    h.vertexBytes = sizeof(Vertex);
+    h.linearNodeBytes = sizeof(LinearBVHNode);
+    h.wideNodeBytes = sizeof(WideBVHNode);
+    h.builder = (uint8_t)options.builder;
+    h.layout = (uint8_t)options.layout;
+    h.sahBins = options.sahBins;
+    h.maxLeafSize = options.maxLeafSize;
+    h.field = scene.camera.field;
+    toFloats(scene.camera.background, h.background);
+    h.materials = (uint32_t)scene.materials.size();
+    h.objects = (uint32_t)objects.size();
+    h.lights = (uint32_t)lights.size();
+    h.meshVertices = (uint32_t)meshVertices.size();
+    h.meshIndices = (uint32_t)meshIndices.size();
+    h.nodes = (uint32_t)(wideLayout ? wide.nodes.size() : bvh.nodes.size());
+    h.leafObjects = (uint32_t)leafObjects.size();
+    h.triangles = (uint32_t)tb.size();
+    h.triangleMeshes = (uint32_t)triangleMeshes.size();
+    h.build = wideLayout ? wide.build : bvh.build;
+
+    std::ofstream out(fn.c_str(), std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+    writeSection(out, &h, sizeof(h));
+    writeSection(out, scene.materials, h.materials);
+    writeSection(out, objects, h.objects);
+    writeSection(out, lights, h.lights);
+    writeSection(out, meshVertices, h.meshVertices);
+    writeSection(out, meshIndices, h.meshIndices);
+    if (wideLayout) {
+        writeSection(out, wide.nodes, h.nodes);
+    } else {
+        writeSection(out, bvh.nodes, h.nodes);
+    }
+    writeSection(out, leafObjects, h.leafObjects);
+    const std::vector<float>* coordinates[] = { &tb.v0x, &tb.v0y, &tb.v0z, &tb.e1x, &tb.e1y, &tb.e1z, &tb.e2x, &tb.e2y, &tb.e2z };
+    for (auto coordinate : coordinates) {
+        writeSection(out, *coordinate, h.triangles);
+    }
+    writeSection(out, tb.normal, h.triangles);
+    writeSection(out, tb.mesh, h.triangles);
+    writeSection(out, tb.index, h.triangles);
+    writeSection(out, triangleMeshes, h.triangleMeshes);
+    return out.good();
+}
+
+/****************************************************************************/
+
+// A whole file mapped read-only, unmapped when this goes out of scope
+struct MappedFile {
+    const char* data;
+    size_t size;
+
+    MappedFile() : data(NULL), size(0) {}
+    ~MappedFile() {
+        if (data != NULL) {
+            munmap((void*)data, size);
+        }
+    }
+
+    bool map(const std::string& fn) {
+        int fd = open(fn.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        data = (const char*)p;
+        size = (size_t)st.st_size;
+        return true;
+    }
+};
+
+// Steps through a mapped file's sections in the order writeSceneCache() wrote them. Once one
+// would run past the end of the file, it and every later one comes back NULL.
+struct SectionReader {
+    const MappedFile& file;
+    size_t offset;
+
+    SectionReader(const MappedFile& _file) : file(_file), offset(0) {}
+
+    template <typename T>
+    const T* next(size_t count) {
+        const size_t bytes = count * sizeof(T);
+        if (offset > file.size || bytes > file.size - offset) {
+            offset = file.size + 1;
+            return NULL;
+        }
+        // the mapping is page aligned and every section starts on a SCENE_CACHE_ALIGN boundary
+        const T* at = (const T*)(file.data + offset);
+        offset += (bytes + SCENE_CACHE_ALIGN - 1) / SCENE_CACHE_ALIGN * SCENE_CACHE_ALIGN;
+        return at;
+    }
+};
+
+template <typename T>
+static void copySection(std::vector<T>& v, const T* data, size_t count) {
+    v.assign(data, data + count);
+}
+
+// Check every index into the scene's arrays before anything is built from them (validNodes()
+// checks the BVH's nodes)
+static bool validIndices(const SceneCacheHeader& h, const CachedObject* objects, const CachedLight* lights, const uint32_t* meshIndices,
+                         const uint32_t* leafObjects, const uint32_t* triangleOwners, const uint32_t* triangleIndices, const uint32_t* triangleMeshes) {
+    for (uint32_t i = 0; i < h.objects; i++) {
+        const CachedObject& c = objects[i];
+        if (c.type > (uint32_t)ObjectType::Mesh || c.material >= h.materials) {
+            return false;
+        }
+        if (c.type != (uint32_t)ObjectType::Mesh) {
+            continue;
+        }
+        if (c.firstVertex > h.meshVertices || c.vertexCount > h.meshVertices - c.firstVertex
+            || c.firstIndex > h.meshIndices || c.indexCount > h.meshIndices - c.firstIndex || c.indexCount % 3 != 0) {
+            return false;
+        }
+        for (uint32_t j = c.firstIndex; j < c.firstIndex + c.indexCount; j++) {
+            if (meshIndices[j] >= c.vertexCount) {
+                return false;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < h.lights; i++) {
+        if (lights[i].type > (uint32_t)LightType::Spot) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h.leafObjects; i++) {
+        if (leafObjects[i] >= h.objects) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h.triangleMeshes; i++) {
+        if (triangleMeshes[i] >= h.objects || objects[triangleMeshes[i]].type != (uint32_t)ObjectType::Mesh) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h.triangles; i++) {
+        if (triangleOwners[i] >= h.triangleMeshes || triangleIndices[i] >= objects[triangleMeshes[triangleOwners[i]]].indexCount / 3) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A leaf's range must lie inside the leaf objects or triangles, and hold no more than the
+// builder puts in one leaf
+static bool validLeaf(const SceneCacheHeader& h, uint32_t first, uint32_t count, bool triangles) {
+    const uint32_t maxLeafSize = (uint32_t)std::min(std::max(1, (int)h.maxLeafSize), BVH_MAX_LEAF_SIZE);
+    const uint32_t size = triangles ? h.triangles : h.leafObjects;
+    return count <= maxLeafSize && first <= size && count <= size - first;
+}
+
+// Check the BVH's nodes before anything is built from them: every child must come after its
+// parent and inside the node section, every leaf must be valid, and no node may be deeper than
+// the traversal stacks allow for (BVH_MAX_DEPTH, as the builder guarantees)
+static bool validNodes(const SceneCacheHeader& h, const LinearBVHNode* linearNodes, const WideBVHNode* wideNodes) {
+    // nodes can only point forwards, so a node's depth is final by the time it's reached
+    std::vector<uint8_t> depth(h.nodes, 0);
+    auto reach = [&](uint32_t parent, uint32_t child) {
+        if (child <= parent || child >= h.nodes || depth[parent] + 1 >= BVH_MAX_DEPTH) {
+            return false;
+        }
+        depth[child] = (uint8_t)std::max<int>(depth[child], depth[parent] + 1);
+        return true;
+    };
+    for (uint32_t i = 0; i < h.nodes; i++) {
+        if (linearNodes != NULL) {
+            const LinearBVHNode& node = linearNodes[i];
+            if (node.objectCount > 0) {
+                if (node.leafTriangles > 1 || !validLeaf(h, node.offset, node.objectCount, node.leafTriangles != 0)) {
+                    return false;
+                }
+            } else if (!reach(i, i + 1) || !reach(i, node.offset)) {
+                return false;
+            }
+            continue;
+        }
+        const WideBVHNode& node = wideNodes[i];
+        if (node.childCount < 1 || node.childCount > BVH_WIDE) {
+            return false;
+        }
+        for (int c = 0; c < node.childCount; c++) {
+            if (node.objectCount[c] > 0) {
+                if (!validLeaf(h, node.child[c], node.objectCount[c], (node.triangleLeaves & (1 << c)) != 0)) {
+                    return false;
+                }
+            } else if (!reach(i, node.child[c])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool readSceneCache(const std::string& fn, const BVHBuildOptions& options, Scene& scene, LinearBVH& bvh, WideBVH& wide) {
+    MappedFile file;
+    if (!file.map(fn)) {
+        std::cout << "*** unable to map scene cache " << fn << std::endl;
+        return false;
+    }
+    SectionReader sections(file);
+
+    const SceneCacheHeader* h = sections.next<SceneCacheHeader>(1);
+    if (h == NULL || memcmp(h->magic, SCENE_CACHE_MAGIC, sizeof(h->magic)) != 0 || h->version != SCENE_CACHE_VERSION
+        || h->headerBytes != sizeof(SceneCacheHeader) || h->materialBytes != sizeof(Material) || h->vertexBytes != sizeof(Vertex)
+        || h->linearNodeBytes != sizeof(LinearBVHNode) || h->wideNodeBytes != sizeof(WideBVHNode)) {
+        std::cout << "*** " << fn << " is not a version " << SCENE_CACHE_VERSION << " scene cache for this build" << std::endl;
+        return false;
+    }
+    if (h->builder != (uint8_t)options.builder || h->layout != (uint8_t)options.layout
+        || h->sahBins != options.sahBins || h->maxLeafSize != options.maxLeafSize) {
+        std::cout << "*** " << fn << " holds a BVH built with other options" << std::endl;
+        return false;
+    }
+    const bool wideLayout = options.layout == BVHLayout::Wide;
+
+    const Material* materials = sections.next<Material>(h->materials);
+    const CachedObject* objects = sections.next<CachedObject>(h->objects);
+    const CachedLight* lights = sections.next<CachedLight>(h->lights);
+    const Vertex* meshVertices = sections.next<Vertex>(h->meshVertices);
+    const uint32_t* meshIndices = sections.next<uint32_t>(h->meshIndices);
+    const LinearBVHNode* linearNodes = wideLayout ? NULL : sections.next<LinearBVHNode>(h->nodes);
+    const WideBVHNode* wideNodes = wideLayout ? sections.next<WideBVHNode>(h->nodes) : NULL;
+    const uint32_t* leafObjects = sections.next<uint32_t>(h->leafObjects);
+    const float* coordinates[9];
+    for (int i = 0; i < 9; i++) {
+        coordinates[i] = sections.next<float>(h->triangles);
+    }
+    const Vector* normals = sections.next<Vector>(h->triangles);
+    const uint32_t* triangleOwners = sections.next<uint32_t>(h->triangles);
+    const uint32_t* triangleIndices = sections.next<uint32_t>(h->triangles);
+    const uint32_t* triangleMeshes = sections.next<uint32_t>(h->triangleMeshes);
+    if (triangleMeshes == NULL) {
+        std::cout << "*** scene cache " << fn << " is truncated" << std::endl;
+        return false;
+    }
+    if (!validIndices(*h, objects, lights, meshIndices, leafObjects, triangleOwners, triangleIndices, triangleMeshes)
+        || !validNodes(*h, linearNodes, wideNodes)) {
+        std::cout << "*** scene cache " << fn << " is corrupt" << std::endl;
+        return false;
+    }
+
+    scene.camera = Camera(h->field, fromFloats(h->background));
+    copySection(scene.materials, materials, h->materials);
+    for (uint32_t i = 0; i < h->objects; i++) {
+        const CachedObject& c = objects[i];
+        const MaterialIndex material = (MaterialIndex)c.material;
+        switch ((ObjectType)c.type) {
+        case ObjectType::Sphere:
+            scene.objects.push_back(scene.arena.make<Sphere>(material, c.radius, fromFloats(c.position)));
+            break;
+        case ObjectType::Plane:
+            scene.objects.push_back(scene.arena.make<Plane>(material, fromFloats(c.position), fromFloats(c.normal)));
+            break;
+        case ObjectType::Mesh:
+            scene.objects.push_back(scene.arena.make<Mesh>(material,
+                std::vector<Vertex>(meshVertices + c.firstVertex, meshVertices + c.firstVertex + c.vertexCount),
+                std::vector<uint32_t>(meshIndices + c.firstIndex, meshIndices + c.firstIndex + c.indexCount)));
+            break;
+        case ObjectType::Instance:
+            break;
+        }
+    }
+    for (uint32_t i = 0; i < h->lights; i++) {
+        const CachedLight& c = lights[i];
+        const RGB color = fromFloats(c.color);
+        switch ((LightType)c.type) {
+        case LightType::Ambient:
+            scene.lights.push_back(scene.arena.make<AmbientLight>(color));
+            break;
+        case LightType::Directional:
+            scene.lights.push_back(scene.arena.make<DirectionalLight>(color, fromFloats(c.direction)));
+            break;
+        case LightType::Point:
+            scene.lights.push_back(scene.arena.make<PointLight>(color, fromFloats(c.position)));
+            break;
+        case LightType::Spot:
+            scene.lights.push_back(scene.arena.make<SpotLight>(color, fromFloats(c.position), fromFloats(c.direction), c.cutoff));
+            break;
+        }
+    }
+
+    std::vector<Object*>& leaves = wideLayout ? wide.objects : bvh.objects;
+    TriangleBuffer& tb = wideLayout ? wide.triangles : bvh.triangles;
+    if (wideLayout) {
+        copySection(wide.nodes, wideNodes, h->nodes);
+        wide.build = h->build;
+    } else {
+        copySection(bvh.nodes, linearNodes, h->nodes);
+        bvh.build = h->build;
+    }
+    leaves.reserve(h->leafObjects);
+    for (uint32_t i = 0; i < h->leafObjects; i++) {
+        leaves.push_back(scene.objects[leafObjects[i]]);
+    }
+    std::vector<float>* tbCoordinates[] = { &tb.v0x, &tb.v0y, &tb.v0z, &tb.e1x, &tb.e1y, &tb.e1z, &tb.e2x, &tb.e2y, &tb.e2z };
+    for (int i = 0; i < 9; i++) {
+        copySection(*tbCoordinates[i], coordinates[i], h->triangles);
+    }
+    copySection(tb.normal, normals, h->triangles);
+    copySection(tb.mesh, triangleOwners, h->triangles);
+    copySection(tb.index, triangleIndices, h->triangles);
+    for (uint32_t i = 0; i < h->triangleMeshes; i++) {
+        tb.meshes.push_back((const Mesh*)scene.objects[triangleMeshes[i]]);
+    }
+    tb.pad();
+    return true;
+}
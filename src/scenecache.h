@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include "schema.h"
+#include "bvh.h"
+
+// A scene cache file holds a loaded scene (camera, material table, objects, lights and indexed
+// meshes) together with the BVH built over it, as arrays laid out as they are in memory.
+// Reading one maps the file and copies those arrays straight into place: there is no JSON to
+// parse and no BVH to build. The layout follows this build's structs, so the header records
+// their sizes, and a file written by a build with a different layout is refused, not misread.
+const char SCENE_CACHE_SUFFIX[] = ".rtscene";
+// bump whenever the file layout changes
+const uint32_t SCENE_CACHE_VERSION = 3;
+
+// Write scene and its BVH (bvh or wide, whichever options.layout says was built) to fn.
+// Returns false if the file could not be written, or if the scene has instances.
+bool writeSceneCache(const std::string& fn, const Scene& scene, const BVHBuildOptions& options, const LinearBVH& bvh, const WideBVH& wide);
+
+// Load fn into an empty scene and BVH. The cache is only used if its BVH was built the way
+// options asks for (builder, layout, bins and leaf size); otherwise, or if the file is missing,
+// truncated or from another version, this returns false and leaves them empty.
+bool readSceneCache(const std::string& fn, const BVHBuildOptions& options, Scene& scene, LinearBVH& bvh, WideBVH& wide);
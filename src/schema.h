@@ -4,10 +4,14 @@
 
 #pragma once
 
+#include <cmath>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <glm/glm.hpp>
 
+#include "arena.h"
+
 typedef glm::vec3 RGB;
 typedef glm::vec3 Vertex;
 typedef glm::vec3 Vector;
@@ -45,11 +49,39 @@ struct Material {
       reflective(_reflective), transmissive(_transmissive), refraction(_refraction) {}
 };
 
+// Type tags, so the renderer can switch on the kind of object or light instead of comparing strings
+enum class ObjectType : uint8_t { Sphere, Plane, Mesh, Instance };
+enum class LightType : uint8_t { Ambient, Directional, Point, Spot };
+
+// the names used for each type in the JSON scene files (and debug output)
+inline const char *objectTypeName(ObjectType type) {
+  switch (type) {
+    case ObjectType::Sphere: return "sphere";
+    case ObjectType::Plane: return "plane";
+    case ObjectType::Mesh: return "mesh";
+    case ObjectType::Instance: return "instance";
+  }
+  return "unknown";
+}
+
+inline const char *lightTypeName(LightType type) {
+  switch (type) {
+    case LightType::Ambient: return "ambient";
+    case LightType::Directional: return "directional";
+    case LightType::Point: return "point";
+    case LightType::Spot: return "spot";
+  }
+  return "unknown";
+}
+
+// Index of a material in Scene::materials; objects with identical materials share one entry
+typedef uint16_t MaterialIndex;
+
 struct Object {
-  std::string type;
-  Material material;
+  ObjectType type;
+  MaterialIndex material;
   
-  Object(std::string _type, Material _material) :
+  Object(ObjectType _type, MaterialIndex _material) :
     type(_type), material(_material) {}
 };
 
@@ -57,61 +89,162 @@ struct Sphere : public Object {
   float radius;
   Vertex position;
 
-  Sphere(Material _material, float _radius, Vertex _position) :
-    Object("sphere", _material), radius(_radius), position(_position) {}
+  Sphere(MaterialIndex _material, float _radius, Vertex _position) :
+    Object(ObjectType::Sphere, _material), radius(_radius), position(_position) {}
 };
 
 struct Plane : public Object {
   Vertex position;
   Vector normal;
   
-  Plane(Material _material, Vertex _position, Vector _normal) :
-    Object("plane", _material), position(_position), normal(_normal) {}
+  Plane(MaterialIndex _material, Vertex _position, Vector _normal) :
+    Object(ObjectType::Plane, _material), position(_position), normal(_normal) {}
 };
 
 struct Triangle {
   Vertex vertices[3];
 };
 
+// An indexed triangle mesh: each vertex is stored once, and each triangle is three indices
+// into vertices, so the triangles around a corner share its vertex
 struct Mesh : public Object {
-  std::vector<Triangle> triangles;
-  Mesh(Material _material, std::vector<Triangle> _triangles) :
-    Object("mesh", _material), triangles(_triangles) {}
+  std::vector<Vertex> vertices;
+  std::vector<uint32_t> indices;    // three per triangle
+
+  Mesh(MaterialIndex _material, std::vector<Vertex> _vertices, std::vector<uint32_t> _indices) :
+    Object(ObjectType::Mesh, _material), vertices(std::move(_vertices)), indices(std::move(_indices)) {}
+
+  size_t triangleCount() const { return indices.size() / 3; }
+  Triangle triangle(size_t i) const {
+    return { { vertices[indices[3 * i]], vertices[indices[3 * i + 1]], vertices[indices[3 * i + 2]] } };
+  }
 };
 
-struct MTriangle : public Object {
-    Triangle triangle;
-    Vertex midPoint;
-    MTriangle(Material _material, Triangle _triangle) :
-        Object("mTriangle", _material), triangle(_triangle) {}
+// An affine transform, as the rows of its 3x3 part and a translation
+struct Transform {
+  Vector rows[3];
+  Vector translation;
+
+  Transform() : rows{ Vector(1,0,0), Vector(0,1,0), Vector(0,0,1) }, translation(0,0,0) {}
+  Transform(const Vector &row0, const Vector &row1, const Vector &row2, const Vector &_translation) :
+    rows{ row0, row1, row2 }, translation(_translation) {}
+
+  // Scale, then rotate about x, y and z (in radians, composed as utils/obj2json.py does), then translate
+  static Transform placement(float scale, const Vector &rotate, const Vector &translate) {
+    const float su = sinf(rotate.x), cu = cosf(rotate.x);
+    const float sv = sinf(rotate.y), cv = cosf(rotate.y);
+    const float sw = sinf(rotate.z), cw = cosf(rotate.z);
+    Transform t;
+    t.rows[0] = scale * Vector(cv * cw, su * sv * cw - cu * sw, su * sw + cu * sv * cw);
+    t.rows[1] = scale * Vector(cv * sw, cu * cw + su * sv * sw, cu * sv * sw - su * cw);
+    t.rows[2] = scale * Vector(-sv, su * cv, cu * cv);
+    t.translation = translate;
+    return t;
+  }
+
+  Vector vector(const Vector &v) const {
+    return Vector(glm::dot(rows[0], v), glm::dot(rows[1], v), glm::dot(rows[2], v));
+  }
+  Vertex point(const Vertex &p) const { return vector(p) + translation; }
+  // By the transpose of the 3x3 part: on the inverse of a transform, this carries normals through it
+  Vector transposed(const Vector &v) const { return rows[0] * v.x + rows[1] * v.y + rows[2] * v.z; }
+
+  // This transform applied after inner
+  Transform after(const Transform &inner) const {
+    Transform t;
+    for (int i = 0; i < 3; i++) {
+      t.rows[i] = rows[i].x * inner.rows[0] + rows[i].y * inner.rows[1] + rows[i].z * inner.rows[2];
+    }
+    t.translation = point(inner.translation);
+    return t;
+  }
+
+  Transform inverse() const {
+    // the inverse of the 3x3 part is its adjugate over its determinant; the columns of the
+    // adjugate are cross products of the rows
+    const Vector c0 = glm::cross(rows[1], rows[2]);
+    const Vector c1 = glm::cross(rows[2], rows[0]);
+    const Vector c2 = glm::cross(rows[0], rows[1]);
+    const float det = glm::dot(rows[0], c0);
+    Transform inv;
+    inv.rows[0] = Vector(c0.x, c1.x, c2.x) / det;
+    inv.rows[1] = Vector(c0.y, c1.y, c2.y) / det;
+    inv.rows[2] = Vector(c0.z, c1.z, c2.z) / det;
+    inv.translation = -inv.vector(translation);
+    return inv;
+  }
+};
+
+// One placement of a shared mesh from Scene::meshes, with its own transform and material. Rays
+// are taken into the mesh's space and traced through that mesh's BVH, so however many
+// instances there are, the triangles are stored (and put in a BVH) once.
+struct Instance : public Object {
+  uint32_t mesh;          // index into Scene::meshes
+  Transform toWorld;
+  Transform toObject;     // the inverse, for taking rays into the mesh's space
+  Vertex boundsMin;       // of the placed mesh, in world space; see bound()
+  Vertex boundsMax;
+
+  Instance(MaterialIndex _material, uint32_t _mesh, const Transform &_toWorld) :
+    Object(ObjectType::Instance, _material), mesh(_mesh), toWorld(_toWorld), toObject(_toWorld.inverse()),
+    boundsMin(0,0,0), boundsMax(0,0,0) {}
+
+  // Move the instance; its bounds are stale until bound() is called again
+  void place(const Transform &_toWorld) {
+    toWorld = _toWorld;
+    toObject = _toWorld.inverse();
+  }
+
+  // Set the world bounds from the corners of the shared mesh's own bounds
+  void bound(const Mesh &shared) {
+    if (shared.vertices.empty()) {
+      return;
+    }
+    Vertex lo = shared.vertices[0], hi = shared.vertices[0];
+    for (const Vertex &v : shared.vertices) {
+      lo = glm::min(lo, v);
+      hi = glm::max(hi, v);
+    }
+    bound(lo, hi);
+  }
+
+  // The same, given those bounds
+  void bound(const Vertex &lo, const Vertex &hi) {
+    boundsMin = boundsMax = toWorld.point(lo);
+    for (int corner = 1; corner < 8; corner++) {
+      const Vertex p = toWorld.point(Vertex(corner & 1 ? hi.x : lo.x, corner & 2 ? hi.y : lo.y, corner & 4 ? hi.z : lo.z));
+      boundsMin = glm::min(boundsMin, p);
+      boundsMax = glm::max(boundsMax, p);
+    }
+  }
 };
 
 struct Light {
-  std::string type;
+  LightType type;
   // for ambient lights, color is ia
   // for all other kinds of lights, color is both id and is
   // you could separate out those two if necessary
   RGB color;
   
-  Light(std::string _type, RGB _color) : type(_type), color(_color) {}
+  Light(LightType _type, RGB _color) : type(_type), color(_color) {}
 };
 
 struct AmbientLight : public Light {
-  AmbientLight(RGB _color) : Light( "ambient", _color) {}
+  AmbientLight(RGB _color) : Light( LightType::Ambient, _color) {}
 };
 
 struct DirectionalLight : public Light {
   Vector direction;
   
   DirectionalLight(RGB _color, Vector _direction) :
-    Light( "directional", _color), direction(_direction) {}
+    Light( LightType::Directional, _color), direction(_direction) {}
 };
 
 struct PointLight : public Light {
   Vertex position;
 
   PointLight(RGB _color, Vertex _position) :
-    Light( "point", _color), position(_position) {}
+    Light( LightType::Point, _color), position(_position) {}
 };
 
 struct SpotLight : public Light {
@@ -121,7 +254,7 @@ struct SpotLight : public Light {
   float cutoff;
 
   SpotLight(RGB _color, Vertex _position, Vector _direction, float _cutoff) :
-    Light( "spot", _color), position(_position), direction(_direction), cutoff(_cutoff) {}
+    Light( LightType::Spot, _color), position(_position), direction(_direction), cutoff(_cutoff) {}
 };
 
 
@@ -129,14 +262,27 @@ struct Scene {
   Camera camera;
   std::vector<Object*> objects;
   std::vector<Light*> lights;
+  std::vector<Material> materials;
+  std::vector<Mesh*> meshes;    // shared by Instance objects; not in objects themselves
+  Arena arena;    // owns the objects, meshes and lights json_to_scene() creates
 };
 
 
+// one triangle of a mesh, as the BVH builder refers to it
+struct TriangleRef
+{
+    const Mesh* mesh;
+    uint32_t index;     // mesh->triangle(index)
+};
+
 struct BVHNode
 {
-    Object* obj;
+    // leaves only, and only one of these: a leaf holds either objects or mesh triangles
+    std::vector<Object*> objects;
+    std::vector<TriangleRef> triangles;
     BVHNode* left;
     BVHNode* right;
     Vector aabbMinBound;
     Vector aabbMaxBound;
+    int axis;   // axis the objects were split along, for interior nodes
 };
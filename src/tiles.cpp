@@ -0,0 +1,109 @@
+#include "tiles.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+struct TileQueue {
+    std::mutex lock;
+    std::deque<Tile> tiles;
+};
+
+static bool popTile(TileQueue& queue, Tile& tile) {
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.tiles.empty()) {
+        return false;
+    }
+    tile = queue.tiles.front();
+    queue.tiles.pop_front();
+    return true;
+}
+
+static bool stealTile(TileQueue& queue, Tile& tile) {
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.tiles.empty()) {
+        return false;
+    }
+    tile = queue.tiles.back();
+    queue.tiles.pop_back();
+    return true;
+}
+
+static void renderTile(const View& view, bool antialias, ShadingMode mode, Framebuffer& fb, const Tile& tile) {
+    for (int y = tile.y0; y < tile.y1; y++) {
+        for (int x = tile.x0; x < tile.x1; x++) {
+            fb.at(x, y) = renderPixel(view, antialias, mode, x, y);
+        }
+    }
+}
+
+static void tileWorker(int self, std::vector<TileQueue>& queues, const View& view, bool antialias, ShadingMode mode, Framebuffer& fb, TileWorkerStats& stats) {
+    const int workers = (int)queues.size();
+    Tile tile;
+    rayStats() = RayStats();
+
+    while (true) {
+        bool stolen = false;
+        bool found = popTile(queues[self], tile);
+        // own queue is empty: look for work on the others, starting with our neighbour
+        for (int i = 1; !found && i < workers; i++) {
+            found = stealTile(queues[(self + i) % workers], tile);
+            stolen = found;
+        }
+        // no new tiles are ever queued, so once every queue is empty we're done
+        if (!found) {
+            break;
+        }
+
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        renderTile(view, antialias, mode, fb, tile);
+        stats.ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        stats.tiles++;
+        if (stolen) {
+            stats.stolen++;
+        }
+    }
+    stats.rays = rayStats();
+}
+
+void renderFrameTiled(const View& view, bool antialias, ShadingMode mode, Framebuffer& fb, const TileOptions& options, std::vector<TileWorkerStats>* stats) {
+    int workers = options.threads;
+    if (workers <= 0) {
+        workers = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    const int tileSize = std::max(1, options.tileSize);
+
+    std::vector<Tile> tiles;
+    for (int y = 0; y < fb.height; y += tileSize) {
+        for (int x = 0; x < fb.width; x += tileSize) {
+            Tile tile = { x, y, std::min(x + tileSize, fb.width), std::min(y + tileSize, fb.height) };
+            tiles.push_back(tile);
+        }
+    }
+    workers = std::max(1, std::min(workers, (int)tiles.size()));
+
+    // hand out contiguous runs so each worker starts on one region of the image
+    std::vector<TileQueue> queues(workers);
+    for (int i = 0; i < workers; i++) {
+        size_t begin = tiles.size() * i / workers;
+        size_t end = tiles.size() * (i + 1) / workers;
+        queues[i].tiles.assign(tiles.begin() + begin, tiles.begin() + end);
+    }
+
+    std::vector<TileWorkerStats> workerStats(workers);
+    std::vector<std::thread> threads;
+    for (int i = 1; i < workers; i++) {
+        threads.push_back(std::thread(tileWorker, i, std::ref(queues), std::cref(view), antialias, mode, std::ref(fb), std::ref(workerStats[i])));
+    }
+    // the calling thread is worker 0
+    tileWorker(0, queues, view, antialias, mode, fb, workerStats[0]);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (stats != NULL) {
+        *stats = workerStats;
+    }
+}
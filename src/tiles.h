@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+#include "camera.h"
+#include "framebuffer.h"
+
+// A rectangle of pixels [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+struct TileOptions {
+    int threads;    // 0 means one per hardware thread
+    int tileSize;   // tiles are tileSize x tileSize pixels (smaller at the right/top edges)
+
+    TileOptions() : threads(0), tileSize(16) {}
+};
+
+// What each worker did during renderFrameTiled()
+struct TileWorkerStats {
+    int tiles;      // tiles rendered, including stolen ones
+    int stolen;     // tiles taken from another worker's queue
+    double ms;      // time spent rendering tiles
+    RayStats rays;  // ray queries made while rendering them
+
+    TileWorkerStats() : tiles(0), stolen(0), ms(0) {}
+};
+
+// Split the image into tiles and render them on a pool of worker threads.
+// Each worker starts with a contiguous run of tiles in its own queue and steals from the back of
+// other queues once its own is empty, so expensive regions don't leave the other threads idle.
+// The scene must be fully loaded (choose_scene()) before calling this; it is only read while rendering.
+void renderFrameTiled(const View& view, bool antialias, ShadingMode mode, Framebuffer& fb, const TileOptions& options, std::vector<TileWorkerStats>* stats);
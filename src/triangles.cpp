@@ -0,0 +1,70 @@
+#include "triangles.h"
+
+#include <glm/glm.hpp>
+
+uint32_t TriangleBuffer::addMesh(const Mesh* owner)
+{
+    meshes.push_back(owner);
+    return (uint32_t)(meshes.size() - 1);
+}
+
+void TriangleBuffer::add(uint32_t owner, uint32_t triangle, const Triangle& tri)
+{
+    const Vertex& a = tri.vertices[0];
+    const Vertex& b = tri.vertices[1];
+    const Vertex& c = tri.vertices[2];
+    const Vector e1 = b - a;
+    const Vector e2 = c - a;
+    v0x.push_back(a.x);
+    v0y.push_back(a.y);
+    v0z.push_back(a.z);
+    e1x.push_back(e1.x);
+    e1y.push_back(e1.y);
+    e1z.push_back(e1.z);
+    e2x.push_back(e2.x);
+    e2y.push_back(e2.y);
+    e2z.push_back(e2.z);
+    normal.push_back(glm::normalize(glm::cross(c - b, a - b)));
+    mesh.push_back(owner);
+    index.push_back(triangle);
+}
+
+void TriangleBuffer::update(uint32_t i)
+{
+    const Triangle tri = owner(i)->triangle(index[i]);
+    const Vertex& a = tri.vertices[0];
+    const Vertex& b = tri.vertices[1];
+    const Vertex& c = tri.vertices[2];
+    const Vector e1 = b - a;
+    const Vector e2 = c - a;
+    v0x[i] = a.x;
+    v0y[i] = a.y;
+    v0z[i] = a.z;
+    e1x[i] = e1.x;
+    e1y[i] = e1.y;
+    e1z[i] = e1.z;
+    e2x[i] = e2.x;
+    e2y[i] = e2.y;
+    e2z[i] = e2.z;
+    normal[i] = glm::normalize(glm::cross(c - b, a - b));
+}
+
+void TriangleBuffer::pad()
+{
+    std::vector<float>* coordinates[] = { &v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z };
+    for (auto coordinate : coordinates)
+    {
+        coordinate->resize(size() + TRIANGLE_LANES - 1, 0.0f);
+        coordinate->shrink_to_fit();
+    }
+    normal.shrink_to_fit();
+    mesh.shrink_to_fit();
+    index.shrink_to_fit();
+    meshes.shrink_to_fit();
+}
+
+size_t TriangleBuffer::bytes() const
+{
+    return 9 * v0x.capacity() * sizeof(float) + normal.capacity() * sizeof(Vector) + (mesh.capacity() + index.capacity()) * sizeof(uint32_t)
+        + meshes.capacity() * sizeof(const Mesh*);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "schema.h"
+
+// Triangles tested together by one SIMD intersection
+const int TRIANGLE_LANES = 4;
+
+// The mesh triangles the BVH holds, stored as a structure of arrays in BVH leaf order, so a
+// leaf's triangles are a contiguous range and TRIANGLE_LANES of them load straight into one
+// SIMD register per coordinate. Only the nearest hit reads the normal and owning mesh, which
+// each triangle names by a 32-bit index into meshes rather than by pointer. Each triangle also
+// keeps its index in that mesh, so refitBVH() can copy it again after the mesh's vertices move.
+struct TriangleBuffer {
+    std::vector<float> v0x, v0y, v0z;   // first vertex
+    std::vector<float> e1x, e1y, e1z;   // vertices[1] - vertices[0]
+    std::vector<float> e2x, e2y, e2z;   // vertices[2] - vertices[0]
+    std::vector<Vector> normal;         // unit normal from the winding
+    std::vector<uint32_t> mesh;         // the triangle's mesh, as an index into meshes
+    std::vector<uint32_t> index;        // and which of that mesh's triangles it is
+    std::vector<const Mesh*> meshes;    // each mesh with triangles in the buffer, once
+
+    size_t size() const { return mesh.size(); }
+    const Mesh* owner(uint32_t triangle) const { return meshes[mesh[triangle]]; }
+    // add a mesh to meshes, returning the index its triangles are added with
+    uint32_t addMesh(const Mesh* owner);
+    void add(uint32_t owner, uint32_t triangle, const Triangle& tri);
+    // copy triangle i from its mesh again
+    void update(uint32_t i);
+    // zero TRIANGLE_LANES - 1 more entries of each coordinate array, so a group starting at
+    // any triangle can be loaded whole; call once every triangle has been added
+    void pad();
+    size_t bytes() const;
+};
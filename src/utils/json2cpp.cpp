@@ -33,45 +33,33 @@ void scene_to_cpp(Scene &s) {
   for (int i = 0; i < s.objects.size(); i++) {
     Object *o = s.objects[i];
     
-    if (o->type == "sphere") {
+    if (o->type == ObjectType::Sphere) {
       Sphere *s = (Sphere *)(o);
       printf("    new Sphere( ");
-      printf_material(s->material);
-      printf(", %f, ", s->radius);
+      printf("%u, %f, ", s->material, s->radius);
       printf_vertex(s->position);
       printf(" )");
 
-    } else if (o->type == "plane") {
+    } else if (o->type == ObjectType::Plane) {
       Plane *p = (Plane *)(o);
       printf("    new Plane( ");
-      printf_material(p->material);
-      printf(", ");
+      printf("%u, ", p->material);
       printf_vertex(p->position);
       printf(", ");
       printf_vector(p->normal);
       printf(" )");
       
-    } else if (o->type == "mesh") {
+    } else if (o->type == ObjectType::Mesh) {
       Mesh *m = (Mesh *)(o);
-      printf("    new Mesh( ");
-      printf_material(m->material);
-      printf(",\n");
-      printf("      {\n");
-      for (int j = 0; j < m->triangles.size(); j++) {
-        printf("         { ");
-        printf_vertex(m->triangles[j].vertices[0]);
-        printf(", ");
-        printf_vertex(m->triangles[j].vertices[1]);
-        printf(", ");
-        printf_vertex(m->triangles[j].vertices[2]);
-        printf(" }");
-        if (j < m->triangles.size() - 1) {
-          printf(",\n");
-        } else {
-          printf("\n");
-        }
-      }
-      printf("      } )");
+      printf("    ");
+      printf_mesh(*m);
+
+    } else if (o->type == ObjectType::Instance) {
+      Instance *n = (Instance *)(o);
+      printf("    new Instance( ");
+      printf("%u, %u, ", n->material, n->mesh);
+      printf_transform(n->toWorld);
+      printf(" )");
     }
     
     if (i < s.objects.size() - 1) {
@@ -88,26 +76,26 @@ void scene_to_cpp(Scene &s) {
   for (int i = 0; i < s.lights.size(); i++) {
     Light *l = s.lights[i];
     
-    if (l->type == "ambient") {
+    if (l->type == LightType::Ambient) {
       AmbientLight *a = (AmbientLight *)(l);
       printf("    new AmbientLight( ");
       printf_rgb(a->color);
       printf(" )");
-    } else if (l->type == "directional") {
+    } else if (l->type == LightType::Directional) {
       DirectionalLight *d = (DirectionalLight *)(l);
       printf("    new DirectionalLight( ");
       printf_rgb(d->color);
       printf(", ");
       printf_vector(d->direction);
       printf(" )");
-    } else if (l->type == "point") {
+    } else if (l->type == LightType::Point) {
       PointLight *p = (PointLight *)(l);
       printf("    new PointLight( ");
       printf_rgb(p->color);
       printf(", ");
       printf_vertex(p->position);
       printf(" )");
-    } else if (l->type == "spot") {
+    } else if (l->type == LightType::Spot) {
       SpotLight *s = (SpotLight *)(l);
       printf("    new SpotLight( ");
       printf_rgb(s->color);
@@ -125,8 +113,37 @@ void scene_to_cpp(Scene &s) {
     }
   }
 
+  printf("  },\n");
+  printf("  // materials\n");
+  printf("  {\n");
+
+  for (size_t i = 0; i < s.materials.size(); i++) {
+    printf("    ");
+    printf_material(s.materials[i]);
+    if (i + 1 < s.materials.size()) {
+      printf(",\n");
+    } else {
+      printf("\n");
+    }
+  }
+
+  printf("  },\n");
+  printf("  // meshes\n");
+  printf("  {\n");
+
+  for (size_t i = 0; i < s.meshes.size(); i++) {
+    printf("    ");
+    printf_mesh(*s.meshes[i]);
+    if (i + 1 < s.meshes.size()) {
+      printf(",\n");
+    } else {
+      printf("\n");
+    }
+  }
+
   printf("  }\n");
   printf("};\n");
+  printf_instance_bounds(s);
 }
 
 /****************************************************************************/
@@ -0,0 +1,68 @@
+#/usr/bin/python3
+#
+# writes a complete JSON scene with one large triangle mesh (a bumpy UV sphere), for
+# benchmarking the acceleration structures on big meshes
+# usage: ./$0 rings segments > ../scenes/big.json
+# (the mesh has 2 * rings * segments triangles, less the degenerate ones at the poles)
+
+import math
+import argparse
+
+parser = argparse.ArgumentParser()
+parser.add_argument("rings", nargs='?', default="100")
+parser.add_argument("segments", nargs='?', default="200")
+parser.add_argument("bumps", nargs='?', default="0.05")
+args = parser.parse_args()
+
+rings = int(args.rings)
+segments = int(args.segments)
+bumps = float(args.bumps)
+radius = 1.0
+centre = (0.0, 0.0, -3.0)
+
+def vertex(r, s):
+    theta = math.pi * r / rings
+    phi = 2 * math.pi * (s % segments) / segments
+    bump = 1 + bumps * math.sin(7 * theta) * math.sin(9 * phi)
+    return (
+        centre[0] + radius * bump * math.sin(theta) * math.cos(phi),
+        centre[1] + radius * bump * math.cos(theta),
+        centre[2] + radius * bump * math.sin(theta) * math.sin(phi)
+    )
+
+def fmt(v):
+    return '[%f,%f,%f]' % v
+
+tris = []
+for r in range(rings):
+    for s in range(segments):
+        a = vertex(r, s)
+        b = vertex(r + 1, s)
+        c = vertex(r + 1, s + 1)
+        d = vertex(r, s + 1)
+        if r != rings - 1:
+            tris.append((a, b, c))
+        if r != 0:
+            tris.append((a, c, d))
+
+print('{')
+print('  "camera": { "field": 60, "background": [0, 0, 0.1] },')
+print('  "objects": [')
+print('    {')
+print('      "type": "mesh",')
+print('      "triangles": [')
+print(',\n'.join('        [ %s, %s, %s ]' % (fmt(t[0]), fmt(t[1]), fmt(t[2])) for t in tris))
+print('      ],')
+print('      "material": { "ambient": [0.2, 0.2, 0.2], "diffuse": [0.3, 0.6, 0.9], "specular": [0.5, 0.5, 0.5], "shininess": 40 }')
+print('    },')
+print('    {')
+print('      "type": "plane", "position": [0, -1.2, 0], "normal": [0, 1, 0],')
+print('      "material": { "ambient": [0.2, 0.2, 0.2], "diffuse": [0.56, 0.24, 0.12] }')
+print('    }')
+print('  ],')
+print('  "lights": [')
+print('    { "type": "ambient", "color": [0.1, 0.1, 0.1] },')
+print('    { "type": "directional", "color": [0.6, 0.6, 0.6], "direction": [-1, -1, -1] },')
+print('    { "type": "point", "color": [0.5, 0.5, 0.5], "position": [2, 2, 0] }')
+print('  ]')
+print('}')